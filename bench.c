@@ -0,0 +1,356 @@
+/*
+ *  Author: Viktor Dukhovni
+ *  License: THIS CODE IS IN THE PUBLIC DOMAIN.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <openssl/pem.h>
+#include <openssl/bio.h>
+#include <openssl/x509.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "danessl.h"
+
+static void print_errors(void)
+{
+    unsigned long err;
+    char buffer[1024];
+    const char *file;
+    const char *data;
+    int line;
+    int flags;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    while ((err = ERR_get_error_all(&file, &line, 0, &data, &flags)) != 0) {
+#else
+    while ((err = ERR_get_error_line_data(&file, &line, &data, &flags)) != 0) {
+#endif
+	ERR_error_string_n(err, buffer, sizeof(buffer));
+	if (flags & ERR_TXT_STRING)
+	    fprintf(stderr, "Error: %s:%s:%d:%s\n", buffer, file, line, data);
+	else
+	    fprintf(stderr, "Error: %s:%s:%d\n", buffer, file, line);
+    }
+}
+
+static void fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "Fatal: ");
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    print_errors();
+    exit(1);
+}
+
+static X509 *load_cert(const char *certfile)
+{
+    X509 *cert = 0;
+    BIO *bp;
+
+    if ((bp = BIO_new_file(certfile, "r")) == NULL)
+	fatal("error opening %s\n", certfile);
+    if (!PEM_read_bio_X509(bp, &cert, 0, 0))
+	fatal("error reading %s\n", certfile);
+    BIO_free(bp);
+    return cert;
+}
+
+/*
+ * Compute the TLSA association data once, outside the timed loop.
+ */
+static unsigned char *tlsa_data(const char *argv[], int *lenp)
+{
+    X509 *cert = load_cert(argv[4]);
+    uint8_t s = atoi(argv[2]);
+    const char *mdname = *argv[3] ? argv[3] : 0;
+    unsigned char *buf = 0;
+    unsigned char *mdbuf;
+    unsigned int mdlen;
+    const EVP_MD *md;
+    int len = 0;
+
+    switch (s) {
+    case DANESSL_SELECTOR_CERT:
+	len = i2d_X509(cert, &buf);
+	break;
+    case DANESSL_SELECTOR_SPKI:
+	len = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), &buf);
+	break;
+    default:
+	fatal("bad selector: %d\n", s);
+    }
+    X509_free(cert);
+    if (len <= 0)
+	fatal("error encoding %s\n", argv[4]);
+
+    if (mdname) {
+	if ((md = EVP_get_digestbyname(mdname)) == 0)
+	    fatal("Invalid certificate digest: %s\n", mdname);
+	if ((mdbuf = OPENSSL_malloc(EVP_MAX_MD_SIZE)) == 0)
+	    fatal("out of memory\n");
+	EVP_Digest(buf, len, mdbuf, &mdlen, md, 0);
+	OPENSSL_free(buf);
+	buf = mdbuf;
+	len = mdlen;
+    }
+    *lenp = len;
+    return buf;
+}
+
+static STACK_OF(X509) *load_chain(const char *chainfile)
+{
+    STACK_OF(X509) *chain;
+    X509 *cert;
+    BIO *bp;
+
+    if ((chain = sk_X509_new_null()) == 0)
+	fatal("out of memory\n");
+    if ((bp = BIO_new_file(chainfile, "r")) == NULL)
+	fatal("error opening chainfile: %s\n", chainfile);
+    while ((cert = PEM_read_bio_X509(bp, 0, 0, 0)) != 0)
+	if (!sk_X509_push(chain, cert))
+	    fatal("out of memory\n");
+    BIO_free(bp);
+    ERR_clear_error();
+    if (sk_X509_num(chain) == 0)
+	fatal("no certificates found in: %s\n", chainfile);
+    return chain;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Time the DANE work of "count" connections: initialization, loading the
+ * TLSA record, chain verification and cleanup.  With a verdict cache, all
+ * but the first verification should be cache hits.
+ */
+static SSL *setup(SSL_CTX *sctx, const char *argv[],
+		  const unsigned char *data, int len,
+		  DANESSL_VERDICTS *verdicts)
+{
+    uint8_t u = atoi(argv[1]);
+    uint8_t s = atoi(argv[2]);
+    const char *mdname = *argv[3] ? argv[3] : 0;
+    SSL *ssl;
+
+    if ((ssl = SSL_new(sctx)) == 0)
+	fatal("error allocating SSL handle\n");
+    if (DANESSL_init(ssl, argv[7], argv + 7) <= 0)
+	fatal("error initializing SSL handle DANE state\n");
+    if (DANESSL_add_tlsa(ssl, u, s, mdname, data, len) <= 0)
+	fatal("error adding TLSA RR\n");
+    if (verdicts && DANESSL_set_verdicts(ssl, verdicts) <= 0)
+	fatal("error attaching verdict cache\n");
+    SSL_set_connect_state(ssl);
+    return ssl;
+}
+
+static void run(const char *name, int count, SSL_CTX *sctx,
+		const char *argv[], const unsigned char *data, int len,
+		STACK_OF(X509) *chain, DANESSL_VERDICTS *verdicts)
+{
+    double start = now();
+    double elapsed;
+    SSL *ssl;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+	ssl = setup(sctx, argv, data, len, verdicts);
+	if (DANESSL_verify_chain(ssl, chain) <= 0
+	    || SSL_get_verify_result(ssl) != X509_V_OK)
+	    fatal("%s: verification failed: %ld\n", name,
+		  SSL_get_verify_result(ssl));
+	DANESSL_cleanup(ssl);
+	SSL_free(ssl);
+    }
+    elapsed = now() - start;
+    printf("%-8s %d verifications, %.1f us each\n", name, count,
+	   1e6 * elapsed / count);
+}
+
+#define ASYNC_INFLIGHT	64
+
+/*
+ * Keep up to ASYNC_INFLIGHT verifications queued to the worker pool, as an
+ * event loop would, polling for completions.  The time reported is elapsed
+ * time divided by the count, so reflects the pool's throughput.
+ */
+static void run_async(const char *name, int count, SSL_CTX *sctx,
+		      const char *argv[], const unsigned char *data, int len,
+		      STACK_OF(X509) *chain, DANESSL_WORKERS *workers)
+{
+    struct pollfd pfd;
+    double start = now();
+    double elapsed;
+    int queued = 0;
+    int done = 0;
+    SSL *ssl;
+    int ret;
+
+    pfd.fd = DANESSL_WORKERS_fd(workers);
+    pfd.events = POLLIN;
+    while (done < count) {
+	for (/* NOP */; queued < count && queued - done < ASYNC_INFLIGHT;
+	     ++queued) {
+	    ssl = setup(sctx, argv, data, len, 0);
+	    if (DANESSL_verify_chain_async(workers, ssl, chain, 0, 0) <= 0)
+		fatal("error queueing verification\n");
+	}
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+	    fatal("poll: %s\n", strerror(errno));
+	while ((ssl = DANESSL_WORKERS_done(workers, &ret)) != 0) {
+	    if (ret <= 0 || SSL_get_verify_result(ssl) != X509_V_OK)
+		fatal("%s: verification failed: %ld\n", name,
+		      SSL_get_verify_result(ssl));
+	    DANESSL_cleanup(ssl);
+	    SSL_free(ssl);
+	    ++done;
+	}
+    }
+    elapsed = now() - start;
+    printf("%-8s %d verifications, %.1f us each\n", name, count,
+	   1e6 * elapsed / count);
+}
+
+/*
+ * Verify "count" copies of the chain as one batch, sharing a single policy,
+ * with one thread per CPU.
+ */
+static void run_batch(const char *name, int count, SSL_CTX *sctx,
+		      const char *argv[], const unsigned char *data, int len,
+		      STACK_OF(X509) *chain)
+{
+    uint8_t u = atoi(argv[1]);
+    uint8_t s = atoi(argv[2]);
+    const char *mdname = *argv[3] ? argv[3] : 0;
+    DANESSL_POLICY *policy;
+    DANESSL_JOB *jobs;
+    DANESSL_RESULT *results;
+    double start;
+    double elapsed;
+    int i;
+
+    if ((policy = DANESSL_POLICY_new()) == 0
+	|| DANESSL_POLICY_add_tlsa(policy, u, s, mdname, data, len) <= 0)
+	fatal("error creating TLSA policy\n");
+    if ((jobs = calloc(count, sizeof(*jobs))) == 0
+	|| (results = calloc(count, sizeof(*results))) == 0)
+	fatal("out of memory\n");
+    for (i = 0; i < count; ++i) {
+	jobs[i].chain = chain;
+	jobs[i].policy = policy;
+	jobs[i].sni_domain = argv[7];
+	jobs[i].hostnames = argv + 7;
+    }
+
+    start = now();
+    if (DANESSL_verify_batch(sctx, 0, jobs, results, count, 0) <= 0)
+	fatal("%s: batch verification failed\n", name);
+    elapsed = now() - start;
+    for (i = 0; i < count; ++i)
+	if (results[i].ret <= 0 || results[i].verify_result != X509_V_OK)
+	    fatal("%s: verification failed: %ld\n", name,
+		  results[i].verify_result);
+    printf("%-8s %d verifications, %.1f us each\n", name, count,
+	   1e6 * elapsed / count);
+
+    free(results);
+    free(jobs);
+    DANESSL_POLICY_free(policy);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s count certificate-usage selector matching-type"
+	    " certfile \\\n\t\tCAfile chainfile hostname [certname ...]\n",
+	    progname);
+    fprintf(stderr, "  where, count = number of verifications per backend,\n");
+    fprintf(stderr, "\t and the remaining arguments are as for \"offline\".\n");
+    exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+    STACK_OF(X509) *chain;
+    SSL_CTX *sctx;
+    DANESSL_VERDICTS *verdicts;
+    DANESSL_WORKERS *workers;
+    unsigned char *data;
+    int count;
+    int len;
+
+    if (argc < 9 || (count = atoi(argv[1])) <= 0)
+	usage(argv[0]);
+    ++argv;
+
+    /* SSL library and DANE library initialization */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    SSL_load_error_strings();
+    SSL_library_init();
+#endif
+
+    if (DANESSL_library_init() <= 0)
+	fatal("error initializing DANE library\n");
+
+    /* Initialize context for DANE connections */
+    if ((sctx = SSL_CTX_new(SSLv23_client_method())) == 0)
+	fatal("error allocating SSL_CTX\n");
+    if (*argv[5] && (SSL_CTX_load_verify_locations(sctx, argv[5], 0)) <= 0)
+	fatal("error loading CAfile\n");
+    if (DANESSL_CTX_init(sctx) <= 0)
+	fatal("error initializing SSL_CTX DANE state\n");
+
+    data = tlsa_data(argv, &len);
+    chain = load_chain(argv[6]);
+
+    if (DANESSL_set_backend(DANESSL_BACKEND_COMPAT) > 0)
+	run("compat", count, sctx, argv, data, len, chain, 0);
+    if (DANESSL_set_backend(DANESSL_BACKEND_NATIVE) > 0)
+	run("native", count, sctx, argv, data, len, chain, 0);
+    else
+	printf("native   not supported\n");
+    ERR_clear_error();
+
+    if ((verdicts = DANESSL_VERDICTS_new(64, 3600)) == 0)
+	fatal("error allocating verdict cache\n");
+    (void) DANESSL_set_backend(DANESSL_BACKEND_AUTO);
+    run("verdicts", count, sctx, argv, data, len, chain, verdicts);
+    DANESSL_VERDICTS_free(verdicts);
+
+    if ((workers = DANESSL_WORKERS_new(0)) != 0) {
+	run_async("async", count, sctx, argv, data, len, chain, workers);
+	DANESSL_WORKERS_free(workers);
+    } else {
+	printf("async    not supported\n");
+	ERR_clear_error();
+    }
+    run_batch("batch", count, sctx, argv, data, len, chain);
+
+    /* Cleanup */
+    DANESSL_thread_stop();
+    sk_X509_pop_free(chain, X509_free);
+    OPENSSL_free(data);
+    SSL_CTX_free(sctx);
+
+    return 0;
+}
@@ -27,7 +27,11 @@ static void print_errors(void)
     int line;
     int flags;
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    while ((err = ERR_get_error_all(&file, &line, 0, &data, &flags)) != 0) {
+#else
     while ((err = ERR_get_error_line_data(&file, &line, &data, &flags)) != 0) {
+#endif
 	ERR_error_string_n(err, buffer, sizeof(buffer));
 	if (flags & ERR_TXT_STRING)
 	    fprintf(stderr, "Error: %s:%s:%d:%s\n", buffer, file, line, data);
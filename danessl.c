@@ -3,8 +3,12 @@
  *  License: THIS CODE IS IN THE PUBLIC DOMAIN.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #include <openssl/opensslv.h>
 #include <openssl/err.h>
@@ -16,13 +20,51 @@
 #include <openssl/evp.h>
 #include <openssl/bn.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+    && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#endif
+
+/* Asynchronous verification needs POSIX threads */
+#if defined(OPENSSL_THREADS) && !defined(_WIN32)
+#define DANE_ASYNC
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#endif
+
 #if OPENSSL_VERSION_NUMBER < 0x1000000fL
 #error "OpenSSL 1.0.0 or higher required"
 #endif
 
+#if OPENSSL_VERSION_NUMBER < 0x10002000L
+#define X509_get_signature_nid(x) OBJ_obj2nid((x)->sig_alg->algorithm)
+#endif
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define X509_get0_authority_key_id(x) \
+	(X509_check_purpose((x), -1, 0), \
+	 (const ASN1_OCTET_STRING *) ((x)->akid ? (x)->akid->keyid : 0))
+#elif OPENSSL_VERSION_NUMBER < 0x10101000L
+#define X509_get0_authority_key_id(x) ((const ASN1_OCTET_STRING *) 0)
+#else
+/*
+ * Unlike X509_get0_subject_key_id(), this does not first cache the
+ * extensions, which another thread sharing the certificate may be doing.
+ */
+#define X509_get0_authority_key_id(x) \
+	(X509_check_purpose((x), -1, 0), X509_get0_authority_key_id(x))
+#endif
+
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #define X509_up_ref(x) CRYPTO_add(&((x)->references), 1, CRYPTO_LOCK_X509)
 #define X509_STORE_CTX_get0_cert(ctx) ((ctx)->cert)
+#define X509_STORE_CTX_get0_store(ctx) ((ctx)->ctx)
 #define X509_STORE_CTX_get0_untrusted(ctx) ((ctx)->untrusted)
 #define X509_STORE_CTX_get0_chain(ctx) ((ctx)->chain)
 #define X509_STORE_CTX_get_verify(ctx) ((ctx)->verify)
@@ -36,10 +78,20 @@
 #define ASN1_STRING_get0_data ASN1_STRING_data
 #define X509_getm_notBefore X509_get_notBefore
 #define X509_getm_notAfter X509_get_notAfter
+#define EVP_MD_CTX_new EVP_MD_CTX_create
+#define X509_get0_subject_key_id(x) \
+	(X509_check_purpose((x), -1, 0), (const ASN1_OCTET_STRING *) (x)->skid)
+#define EVP_MD_CTX_free EVP_MD_CTX_destroy
+#define OPENSSL_strdup BUF_strdup
 #define CRYPTO_ONCE_STATIC_INIT 0
 #define CRYPTO_THREAD_run_once run_once
+#define SSL_get_security_level(s) 0
+#define X509_VERIFY_PARAM_get_auth_level(param) -1
 typedef int CRYPTO_ONCE;
 #endif
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#define EVP_MD_CTX_get0_md EVP_MD_CTX_md
+#endif
 
 #include "danessl.h"
 
@@ -48,10 +100,22 @@ typedef int CRYPTO_ONCE;
 #define DANESSL_F_CHECK_END_ENTITY	102
 #define DANESSL_F_CTX_INIT		103
 #define DANESSL_F_DANESSL_VERIFY_CHAIN	113
+#define DANESSL_F_ADD_TLSA_RRSET	114
+#define DANESSL_F_ADD_TLSA_RDATA	115
+#define DANESSL_F_POLICY_ADD		116
+#define DANESSL_F_POLICY_NEW		117
+#define DANESSL_F_SET_POLICY		118
+#define DANESSL_F_CACHE_ADD		119
+#define DANESSL_F_CACHE_NEW		120
+#define DANESSL_F_SET_BACKEND		121
+#define DANESSL_F_VERDICTS_NEW		122
+#define DANESSL_F_SET_VERDICTS		123
+#define DANESSL_F_WORKERS_NEW		124
+#define DANESSL_F_VERIFY_CHAIN_ASYNC	125
+#define DANESSL_F_VERIFY_BATCH		126
 #define DANESSL_F_GROW_CHAIN		104
 #define DANESSL_F_INIT			105
 #define DANESSL_F_LIBRARY_INIT		106
-#define DANESSL_F_LIST_ALLOC		107
 #define DANESSL_F_MATCH			108
 #define DANESSL_F_PUSH_EXT		109
 #define DANESSL_F_SET_TRUST_ANCHOR	110
@@ -71,6 +135,10 @@ typedef int CRYPTO_ONCE;
 #define DANESSL_R_NOSIGN_KEY		110
 #define DANESSL_R_SCTX_INIT		111
 #define DANESSL_R_SUPPORT		112
+#define DANESSL_R_POLICY_FROZEN		113
+#define DANESSL_R_BAD_BACKEND		114
+#define DANESSL_R_RECORDS_FIXED		115
+#define DANESSL_R_RECORDS_PRIVATE	116
 
 #ifndef OPENSSL_NO_ERR
 #define	DANESSL_F_PLACEHOLDER		0		/* FIRST! Value TBD */
@@ -78,20 +146,33 @@ static ERR_STRING_DATA dane_str_functs[] = {
     {DANESSL_F_PLACEHOLDER,		"DANE library"},	/* FIRST!!! */
     {DANESSL_F_ADD_SKID,		"add_skid"},
     {DANESSL_F_ADD_TLSA,		"DANESSL_add_tlsa"},
+    {DANESSL_F_ADD_TLSA_RDATA,		"DANESSL_add_tlsa_rdata"},
+    {DANESSL_F_ADD_TLSA_RRSET,		"DANESSL_add_tlsa_rrset"},
+    {DANESSL_F_CACHE_ADD,		"DANESSL_CACHE_add"},
+    {DANESSL_F_CACHE_NEW,		"DANESSL_CACHE_new"},
     {DANESSL_F_CHECK_END_ENTITY,	"check_end_entity"},
     {DANESSL_F_CTX_INIT,		"DANESSL_CTX_init"},
     {DANESSL_F_GROW_CHAIN,		"grow_chain"},
     {DANESSL_F_INIT,			"DANESSL_init"},
     {DANESSL_F_LIBRARY_INIT,		"DANESSL_library_init"},
-    {DANESSL_F_LIST_ALLOC,		"list_alloc"},
     {DANESSL_F_MATCH,			"match"},
+    {DANESSL_F_POLICY_ADD,		"DANESSL_POLICY_add_tlsa"},
+    {DANESSL_F_POLICY_NEW,		"DANESSL_POLICY_new"},
     {DANESSL_F_PUSH_EXT,		"push_ext"},
+    {DANESSL_F_SET_BACKEND,		"DANESSL_set_backend"},
+    {DANESSL_F_SET_POLICY,		"DANESSL_set_policy"},
     {DANESSL_F_SET_TRUST_ANCHOR,	"set_trust_anchor"},
+    {DANESSL_F_SET_VERDICTS,		"DANESSL_set_verdicts"},
+    {DANESSL_F_VERDICTS_NEW,		"DANESSL_VERDICTS_new"},
     {DANESSL_F_VERIFY_CERT,		"verify_cert"},
+    {DANESSL_F_VERIFY_BATCH,		"DANESSL_verify_batch"},
+    {DANESSL_F_VERIFY_CHAIN_ASYNC,	"DANESSL_verify_chain_async"},
+    {DANESSL_F_WORKERS_NEW,		"DANESSL_WORKERS_new"},
     {DANESSL_F_WRAP_CERT,		"wrap_cert"},
     {0,					NULL}
 };
 static ERR_STRING_DATA dane_str_reasons[] = {
+    {DANESSL_R_BAD_BACKEND,	"Unknown verification backend"},
     {DANESSL_R_BAD_CERT,	"Bad TLSA record certificate"},
     {DANESSL_R_BAD_CERT_PKEY,	"Bad TLSA record certificate public key"},
     {DANESSL_R_BAD_DATA_LENGTH,	"Bad TLSA record digest length"},
@@ -103,6 +184,9 @@ static ERR_STRING_DATA dane_str_reasons[] = {
     {DANESSL_R_INIT,		"DANESSL_init() required"},
     {DANESSL_R_LIBRARY_INIT,	"DANESSL_library_init() required"},
     {DANESSL_R_NOSIGN_KEY,	"Certificate usage 2 requires EC support"},
+    {DANESSL_R_POLICY_FROZEN,	"TLSA policy is shared and immutable"},
+    {DANESSL_R_RECORDS_FIXED,	"TLSA records already used to verify"},
+    {DANESSL_R_RECORDS_PRIVATE,	"Connection has TLSA records of its own"},
     {DANESSL_R_SCTX_INIT,	"DANESSL_CTX_init() required"},
     {DANESSL_R_SUPPORT,		"DANE library features not supported"},
     {0,				NULL}
@@ -113,6 +197,43 @@ static ERR_STRING_DATA dane_str_reasons[] = {
 
 static int err_lib_dane = -1;
 static int dane_idx = -1;
+static int ssl_store_idx = -1;		/* SSL of an X509_STORE_CTX */
+static ASN1_OBJECT *server_auth;
+
+/*
+ * Flags read by one thread after another may have set them are loaded with
+ * acquire and stored with release semantics.
+ */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L \
+    && !defined(__STDC_NO_ATOMICS__)
+typedef atomic_int dane_atomic;
+#define dane_atomic_get(p) atomic_load_explicit((p), memory_order_acquire)
+#define dane_atomic_set(p, v) \
+	atomic_store_explicit((p), (v), memory_order_release)
+#elif defined(__GNUC__)
+typedef int dane_atomic;
+#define dane_atomic_get(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define dane_atomic_set(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+typedef volatile int dane_atomic;
+#define dane_atomic_get(p) (*(p))
+#define dane_atomic_set(p, v) (*(p) = (v))
+#endif
+
+/*
+ * All the library globals are set by dane_init(), which then publishes
+ * them by setting "dane_ready".  Every entry point checks it first, and may
+ * then read the globals without locks, so connections never initialize
+ * anything lazily or race with DANESSL_library_init() in another thread.
+ */
+static dane_atomic dane_ready;
+#define dane_ready_get() dane_atomic_get(&dane_ready)
+#define dane_ready_set() dane_atomic_set(&dane_ready, 1)
+
+/*
+ * Digest algorithms of the standard matching types, resolved once.
+ */
+static const EVP_MD *mtype_md[DANESSL_MATCHING_LAST + 1];
 
 #ifdef X509_V_FLAG_PARTIAL_CHAIN       /* OpenSSL >= 1.0.2 */
 static int wrap_to_root = 0;
@@ -120,61 +241,309 @@ static int wrap_to_root = 0;
 static int wrap_to_root = 1;
 #endif
 
-static void (*cert_free)(void *) = (void (*)(void *)) X509_free;
-static void (*pkey_free)(void *) = (void (*)(void *)) EVP_PKEY_free;
+/*
+ * Reference names, compiled by DANESSL_init() into sorted tables of keys:
+ * the lower-case name with its labels in reverse order, so "mx.example.com"
+ * becomes "com.example.mx".  A domain and all its sub-domains then have
+ * keys with a common prefix.  Exact names, the parent domains of those
+ * names for wildcard matches, and the domains of the ".domain" sub-domain
+ * form each have their own table.  Longer names than any DNS name are
+ * ignored.
+ *
+ * Tables of DANE_NAMES_HASH or more keys, as with policies that list a
+ * large provider's whole MX set, are also indexed by an open-addressed
+ * hash set, so that each lookup costs the same however many names there
+ * are.  The sorted order remains for the (multi-label wildcard) prefix
+ * searches.
+ */
+#define DANE_NAME_MAX	255
+#define DANE_NAMES_HASH	16
+
+typedef struct dane_name {
+    const char *key;
+    size_t len;
+} dane_name;
+
+typedef struct dane_nametab {
+    dane_name *tab;
+    int n;
+    int *slots;				/* Hash index or null, -1 if empty */
+    size_t mask;
+} dane_nametab;
+
+typedef struct dane_names {
+    dane_nametab exact;
+    dane_nametab parents;
+    dane_nametab subdomains;
+} dane_names;
+
+/*
+ * Bump allocator for TLSA data that lives as long as the DANESSL handle.
+ * Individual allocations are never freed, the whole arena is released at
+ * once.  Loading an RRset in one batch reserves all its space up front, so
+ * that the compiled tables occupy a single block.
+ */
+typedef struct dane_arena_block {
+    struct dane_arena_block *next;
+    size_t size;
+    size_t used;
+} dane_arena_block;
+
+typedef struct dane_arena {
+    dane_arena_block *head;
+} dane_arena;
+
+#define DANE_ARENA_ALIGN	16
+#define DANE_ARENA_BLOCK	4096
+#define DANE_ARENA_ROUND(n) \
+	(((n) + DANE_ARENA_ALIGN - 1) & ~((size_t) DANE_ARENA_ALIGN - 1))
+#define DANE_ARENA_HDR	DANE_ARENA_ROUND(sizeof(dane_arena_block))
+
+typedef struct dane_arena_mark {
+    dane_arena_block *block;
+    size_t used;
+} dane_arena_mark;
+
+/*
+ * The arena functions queue no errors, their callers report allocation
+ * failures under their own function codes.
+ */
+static int arena_reserve(dane_arena *a, size_t n)
+{
+    dane_arena_block *b = a->head;
+    size_t size;
 
-typedef struct dane_list {
-    struct dane_list *next;
-    void *value;
-} *dane_list;
+    n = DANE_ARENA_ROUND(n);
+    if (b && b->size - b->used >= n)
+	return 1;
 
-#define LINSERT(h, e) do { (e)->next = (h); (h) = (e); } while (0)
+    size = b ? 2 * b->size : DANE_ARENA_BLOCK;
+    if (size < n)
+	size = n;
+    if ((b = OPENSSL_malloc(DANE_ARENA_HDR + size)) == 0)
+	return 0;
+    b->size = size;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+    return 1;
+}
 
-typedef struct DANE_HOST_LIST {
-    struct DANE_HOST_LIST *next;
-    char *value;
-} *DANE_HOST_LIST;
+static void *arena_alloc(dane_arena *a, size_t n)
+{
+    dane_arena_block *b;
+    void *p;
 
-typedef struct dane_data {
-    size_t datalen;
-    unsigned char data[0];
-} *dane_data;
+    if (!arena_reserve(a, n))
+	return 0;
+    b = a->head;
+    p = (unsigned char *) b + DANE_ARENA_HDR + b->used;
+    b->used += DANE_ARENA_ROUND(n);
+    return p;
+}
 
-typedef struct DANE_DATA_LIST {
-    struct DANE_DATA_LIST *next;
-    dane_data value;
-} *DANE_DATA_LIST;
+static char *arena_strdup(dane_arena *a, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy;
 
-typedef struct dane_mtype {
-    int mdlen;
-    const EVP_MD *md;
-    DANE_DATA_LIST data;
-} *dane_mtype;
+    if ((copy = arena_alloc(a, len)) != 0)
+	memcpy(copy, str, len);
+    return copy;
+}
+
+/*
+ * A mark records the fill level of an arena, rewinding to it releases any
+ * later allocations.
+ */
+static void arena_mark(dane_arena *a, dane_arena_mark *m)
+{
+    m->block = a->head;
+    m->used = a->head ? a->head->used : 0;
+}
+
+static void arena_rewind(dane_arena *a, const dane_arena_mark *m)
+{
+    dane_arena_block *b;
+
+    while ((b = a->head) != m->block) {
+	a->head = b->next;
+	OPENSSL_free(b);
+    }
+    if (b)
+	b->used = m->used;
+}
+
+/*
+ * Empty the arena, keeping only its newest and largest block for reuse.
+ */
+static void arena_clear(dane_arena *a)
+{
+    dane_arena_block *b = a->head;
+    dane_arena_block *next;
+
+    if (b == 0)
+	return;
+    for (next = b->next; next; next = b->next) {
+	b->next = next->next;
+	OPENSSL_free(next);
+    }
+    b->used = 0;
+}
+
+/*
+ * Whether "p" points into an allocation from the arena.
+ */
+static int arena_owns(const dane_arena *a, const void *p)
+{
+    const unsigned char *c = p;
+    const dane_arena_block *b;
+
+    for (b = a->head; b; b = b->next) {
+	const unsigned char *base = (const unsigned char *) b + DANE_ARENA_HDR;
+
+	if (c >= base && c < base + b->used)
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Copy "n" bytes at "p" into an arena with the space already reserved.
+ */
+static void *arena_move(dane_arena *a, const void *p, size_t n)
+{
+    void *copy;
+
+    if (n == 0)
+	return 0;
+    if ((copy = arena_alloc(a, n)) != 0)
+	memcpy(copy, p, n);
+    return copy;
+}
+
+static void arena_free(dane_arena *a)
+{
+    dane_arena_block *b;
+    dane_arena_block *next;
+
+    for (b = a->head; b; b = next) {
+	next = b->next;
+	OPENSSL_free(b);
+    }
+    a->head = 0;
+}
 
-typedef struct DANE_MTYPE_LIST {
-    struct DANE_MTYPE_LIST *next;
-    dane_mtype value;
-} *DANE_MTYPE_LIST;
+/*
+ * Compiled TLSA association data.  Each usage has a table with one group
+ * per (selector, digest) pair, ordered by selector, so that match() need
+ * only encode a certificate or public key once per selector.  The data of
+ * each group is located via an index of (data, length) pairs sorted by
+ * length and then content, so that a candidate digest is found by binary
+ * search rather than a list walk.  The data itself is copied into the
+ * arena, or, when loaded with DANESSL_RDATA_NOCOPY, left in the caller's
+ * buffer.
+ */
+typedef struct dane_entry {
+    const unsigned char *data;
+    size_t len;
+} dane_entry;
 
-typedef struct dane_selector {
+typedef struct dane_group {
     uint8_t selector;
-    DANE_MTYPE_LIST mtype;
-} *dane_selector;
+    const EVP_MD *md;
+    int mdlen;
+    int nent;
+    size_t ment;
+    dane_entry *ent;			/* Sorted association data index */
+} dane_group;
+
+typedef struct dane_table {
+    int ngroups;
+    size_t mgroups;
+    dane_group *groups;			/* Ordered by selector */
+} dane_table;
+
+/*
+ * DANE-TA(2) trust-anchor certificates, ordered by subject name hash, and
+ * bare public keys, ordered by RFC 5280 key identifier, so that only the
+ * likely issuers of a certificate need to be tried.
+ */
+typedef struct dane_ta_cert {
+    unsigned long hash;			/* Subject name hash */
+    const ASN1_OCTET_STRING *skid;
+    X509 *cert;
+} dane_ta_cert;
+
+typedef struct dane_ta_key {
+    unsigned char keyid[SHA_DIGEST_LENGTH];
+    int type;				/* EVP_PKEY_base_id() */
+    EVP_PKEY *pkey;
+} dane_ta_key;
+
+/*
+ * A compiled TLSA RRset.  Once attached to a connection by
+ * DANESSL_set_policy() a policy is immutable, and may be shared by any
+ * number of connections in any number of threads, it is freed when the last
+ * reference goes away.  Records added directly to a connection go into a
+ * private policy of its own.
+ */
+struct DANESSL_POLICY {
+    dane_table     tables[DANESSL_USAGE_LAST + 1];
+    dane_arena     arena;		/* Storage for the above tables */
+    dane_ta_cert   *tacerts;		/* In the arena */
+    int		   ntacerts;
+    size_t	   mtacerts;
+    dane_ta_key    *takeys;		/* In the arena */
+    int		   ntakeys;
+    size_t	   mtakeys;
+    int		   count;		/* Number of TLSA records */
+    dane_atomic	   frozen;		/* Attached, and hence immutable */
+    int		   references;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    CRYPTO_RWLOCK  *lock;
+#endif
+};
+
+/*
+ * Placeholder policy of connections with no TLSA records.
+ */
+static DANESSL_POLICY no_policy;
 
-typedef struct DANE_SELECTOR_LIST {
-    struct DANE_SELECTOR_LIST *next;
-    dane_selector value;
-} *DANE_SELECTOR_LIST;
+/*
+ * Per-verification memo of the DER encodings and digests computed by
+ * match().  A single chain element may be matched against the DANE-EE,
+ * DANE-TA and PKIX TLSA records in turn, this ensures that each element is
+ * encoded and hashed at most once per (selector, digest) pair.  The memo is
+ * keyed by certificate pointer, and so must not outlive the verification.
+ */
+typedef struct dane_memo {
+    X509 *cert;
+    const EVP_MD *md;			/* NULL for the DER form itself */
+    uint8_t selector;
+    unsigned int len;
+    size_t off;				/* DER form offset, when md is NULL */
+    unsigned char mdbuf[EVP_MAX_MD_SIZE];
+} dane_memo;
 
-typedef struct DANE_PKEY_LIST {
-    struct DANE_PKEY_LIST *next;
-    EVP_PKEY *value;
-} *DANE_PKEY_LIST;
+/*
+ * Index of the peer's untrusted chain, ordered by subject name hash and then
+ * by position in the chain, so that the issuer of each certificate is found
+ * by lookup rather than by trying every remaining certificate in turn.
+ */
+typedef struct dane_issuer {
+    unsigned long hash;			/* Subject name hash */
+    const ASN1_OCTET_STRING *skid;
+    X509 *cert;
+    int pos;				/* Position in the peer's chain */
+    int used;				/* Already consumed */
+} dane_issuer;
 
-typedef struct DANE_CERT_LIST {
-    struct DANE_CERT_LIST *next;
-    X509 *value;
-} *DANE_CERT_LIST;
+/*
+ * Up to this many digests of a DER object are computed in a single pass.
+ */
+#define DANE_MAX_MDS	4
+#define DANE_MD_CHUNK	512
 
 typedef struct DANESSL {
     int            (*verify)(X509_STORE_CTX *);
@@ -182,1163 +551,4320 @@ typedef struct DANESSL {
     STACK_OF(X509) *chain;
     X509           *match;		/* Matched cert */
     const char     *thost;		/* TLSA base domain */
-    char	   *mhost;		/* Matched peer name */
-    DANE_PKEY_LIST pkeys;
-    DANE_CERT_LIST certs;
-    DANE_HOST_LIST hosts;
-    DANE_SELECTOR_LIST selectors[DANESSL_USAGE_LAST + 1];
+    char	   *mhost;		/* Matched peer name, in the arena */
+    DANESSL_POLICY *policy;		/* TLSA records */
+    dane_names     names;		/* Reference names, in the arena */
+    dane_arena     arena;		/* Per-connection storage */
+    dane_arena_mark mark;		/* Arena level after DANESSL_init() */
+    struct DANESSL *next;		/* Free-list of recycled handles */
+    dane_memo      *memo;		/* Per-verification digest memo */
+    int		   nmemo;
+    int		   mmemo;
+    EVP_MD_CTX	   *mdctx[DANE_MAX_MDS];	/* Reusable digest contexts */
+    unsigned char  *der;		/* Memoized DER encodings */
+    size_t	   derlen;
+    size_t	   dermax;
+    dane_issuer    *issuers;		/* Per-verification chain index */
+    int		   missuers;
     int            depth;
     int		   mdpth;		/* Depth of matched cert */
     int		   multi;		/* Multi-label wildcards? */
-    int		   count;		/* Number of TLSA records */
+    int		   native;		/* Verified by OpenSSL's DANE code */
+    int		   fixed;		/* Records used to verify */
+    DANESSL_POLICY *loaded;		/* Policy handed to OpenSSL */
+    int		   nloaded;		/* Number of its records */
+    struct DANESSL_VERDICTS *verdicts;	/* Optional verdict cache */
 } DANESSL;
 
 #ifndef X509_V_ERR_HOSTNAME_MISMATCH
 #define X509_V_ERR_HOSTNAME_MISMATCH X509_V_ERR_APPLICATION_VERIFICATION
 #endif
 
-static int match(DANE_SELECTOR_LIST slist, X509 *cert, int depth)
+static int entry_cmp(const dane_entry *e,
+		     const unsigned char *data, size_t len)
 {
-    int matched;
-
-    /*
-     * Note, set_trust_anchor() needs to know whether the match was for a
-     * pkey digest or a certificate digest.  We return MATCHED_PKEY or
-     * MATCHED_CERT accordingly.
-     */
-#define MATCHED_CERT (DANESSL_SELECTOR_CERT + 1)
-#define MATCHED_PKEY (DANESSL_SELECTOR_SPKI + 1)
-
-    /*
-     * Loop over each selector, mtype, and associated data element looking
-     * for a match.
-     */
-    for (matched = 0; !matched && slist; slist = slist->next) {
-	DANE_MTYPE_LIST m;
-	unsigned char mdbuf[EVP_MAX_MD_SIZE];
-	unsigned char *buf;
-	unsigned char *buf2;
-	unsigned int len;
-
-	/*
-	 * Extract ASN.1 DER form of certificate or public key.
-	 */
-	switch (slist->value->selector) {
-	case DANESSL_SELECTOR_CERT:
-	    len = i2d_X509(cert, NULL);
-	    buf2 = buf = (unsigned char *) OPENSSL_malloc(len);
-	    if (buf)
-		i2d_X509(cert, &buf2);
-	    break;
-	case DANESSL_SELECTOR_SPKI:
-	    len = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), NULL);
-	    buf2 = buf = (unsigned char *) OPENSSL_malloc(len);
-	    if (buf)
-		i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), &buf2);
-	    break;
-	}
+    if (e->len != len)
+	return e->len < len ? -1 : 1;
+    return memcmp(e->data, data, len);
+}
 
-	if (buf == NULL) {
-	    DANEerr(DANESSL_F_MATCH, ERR_R_MALLOC_FAILURE);
-	    return 0;
-	}
-	OPENSSL_assert(buf2 - buf == len);
+/*
+ * Binary search for the given association data.  Returns 1 if found, and
+ * otherwise 0, with the insertion point stored in *pos in either case.
+ */
+static int group_find(dane_group *g, const unsigned char *data, size_t len,
+		      int *pos)
+{
+    int lo = 0;
+    int hi = g->nent;
 
-	/*
-	 * Loop over each mtype and data element
-	 */
-	for (m = slist->value->mtype; !matched && m; m = m->next) {
-	    DANE_DATA_LIST d;
-	    unsigned char *cmpbuf = buf;
-	    unsigned int cmplen = len;
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	int cmp = entry_cmp(g->ent + mid, data, len);
 
-	    /*
-	     * If it is a digest, compute the corresponding digest of the
-	     * DER data for comparison, otherwise, use the full object.
-	     */
-	    if (m->value->md) {
-		cmpbuf = mdbuf;
-		if (!EVP_Digest(buf, len, cmpbuf, &cmplen, m->value->md, 0))
-		    matched = -1;
-	    }
-	    for (d = m->value->data; !matched && d; d = d->next)
-		if (cmplen == d->value->datalen &&
-		    memcmp(cmpbuf, d->value->data, cmplen) == 0)
-		    matched = slist->value->selector + 1;
+	if (cmp == 0) {
+	    if (pos)
+		*pos = mid;
+	    return 1;
 	}
-
-	OPENSSL_free(buf);
+	if (cmp < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
     }
-
-    return matched;
+    if (pos)
+	*pos = lo;
+    return 0;
 }
 
-static int push_ext(X509 *cert, X509_EXTENSION *ext)
+static void memo_reset(DANESSL *dane)
 {
-    if (ext) {
-	if (X509_add_ext(cert, ext, -1))
-	    return 1;
-	X509_EXTENSION_free(ext);
-    }
-    DANEerr(DANESSL_F_PUSH_EXT, ERR_R_MALLOC_FAILURE);
-    return 0;
+    dane->nmemo = 0;
+    dane->derlen = 0;
 }
 
-static int add_ext(X509 *issuer, X509 *subject, int ext_nid, char *ext_val)
+/*
+ * Return one of the handle's digest contexts, allocating it on first use.
+ * Prefer the context last used with "md", which older OpenSSL releases
+ * reinitialize without reallocating its state.  With all in use, the
+ * first is shared.
+ */
+static EVP_MD_CTX *md_ctx(DANESSL *dane, const EVP_MD *md)
 {
-    X509V3_CTX v3ctx;
+    int i;
 
-    X509V3_set_ctx(&v3ctx, issuer, subject, 0, 0, 0);
-    return push_ext(subject, X509V3_EXT_conf_nid(0, &v3ctx, ext_nid, ext_val));
+    for (i = 0; i < DANE_MAX_MDS && dane->mdctx[i]; ++i)
+	if (EVP_MD_CTX_get0_md(dane->mdctx[i]) == md)
+	    return dane->mdctx[i];
+    if (i == DANE_MAX_MDS)
+	return dane->mdctx[0];
+    return dane->mdctx[i] = EVP_MD_CTX_new();
 }
 
-static int set_serial(X509 *cert, AUTHORITY_KEYID *akid, X509 *subject)
+static int der_grow(DANESSL *dane, size_t len)
 {
-    int ret = 0;
-    BIGNUM *bn;
-
-    if (akid && akid->serial)
-	return (X509_set_serialNumber(cert, akid->serial));
-
-    /*
-     * Add one to subject's serial to avoid collisions between TA serial and
-     * serial of signing root.
-     */
-    if ((bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(subject), 0)) != 0
-	&& BN_add_word(bn, 1)
-	&& BN_to_ASN1_INTEGER(bn, X509_get_serialNumber(cert)))
-	ret = 1;
+    size_t n = dane->dermax ? 2 * dane->dermax : 4096;
+    unsigned char *tmp;
 
-    if (bn)
-	BN_free(bn);
-    return ret;
+    while (n < dane->derlen + len)
+	n *= 2;
+    if ((tmp = OPENSSL_realloc(dane->der, n)) == 0)
+	return 0;
+    dane->der = tmp;
+    dane->dermax = n;
+    return 1;
 }
 
-static int add_akid(X509 *cert, AUTHORITY_KEYID *akid)
+static dane_memo *memo_new(DANESSL *dane, X509 *cert, uint8_t selector,
+			   const EVP_MD *md)
 {
-    int nid = NID_authority_key_identifier;
-    ASN1_OCTET_STRING *id;
-    unsigned char c = 0;
-    int ret = 0;
+    dane_memo *m;
 
-    /*
-     * 0 will never be our subject keyid from a SHA-1 hash, but it could be
-     * our subject keyid if forced from child's akid.  If so, set our
-     * authority keyid to 1.  This way we are never self-signed, and thus
-     * exempt from any potential (off by default for now in OpenSSL)
-     * self-signature checks!
-     */
-    id =  (akid && akid->keyid) ? akid->keyid : 0;
-    if (id && ASN1_STRING_length(id) == 1 && *ASN1_STRING_get0_data(id) == c)
-	c = 1;
+    if (dane->nmemo == dane->mmemo) {
+	int n = dane->mmemo ? 2 * dane->mmemo : 8;
 
-    if ((akid = AUTHORITY_KEYID_new()) != 0
-	&& (akid->keyid = ASN1_OCTET_STRING_new()) != 0
-	&& ASN1_OCTET_STRING_set(akid->keyid, (void *) &c, 1)
-	&& X509_add1_ext_i2d(cert, nid, akid, 0, X509V3_ADD_APPEND))
-	ret = 1;
-    if (akid)
-	AUTHORITY_KEYID_free(akid);
-    return ret;
+	if ((m = OPENSSL_realloc(dane->memo, n * sizeof(*m))) == 0) {
+	    DANEerr(DANESSL_F_MATCH, ERR_R_MALLOC_FAILURE);
+	    return 0;
+	}
+	dane->memo = m;
+	dane->mmemo = n;
+    }
+    m = dane->memo + dane->nmemo++;
+    m->cert = cert;
+    m->selector = selector;
+    m->md = md;
+    m->off = 0;
+    m->len = 0;
+    return m;
 }
 
-static int add_skid(X509 *cert, AUTHORITY_KEYID *akid)
+/*
+ * Return the DER form (md == NULL) or digest of the certificate or public
+ * key of "cert", computing it only if not already in the memo.  The result
+ * remains valid until the next call.
+ */
+static int memo_get(DANESSL *dane, X509 *cert, uint8_t selector,
+		    const EVP_MD *md, const unsigned char **data,
+		    unsigned int *len)
 {
-    int nid = NID_subject_key_identifier;
-
-    if (!akid || !akid->keyid)
-	return add_ext(0, cert, nid, "hash");
-    return X509_add1_ext_i2d(cert, nid, akid->keyid, 0, X509V3_ADD_APPEND) > 0;
-}
+    const unsigned char *der;
+    unsigned int derlen;
+    unsigned char *buf;
+    dane_memo *m;
+    int i;
 
-static X509_NAME *akid_issuer_name(AUTHORITY_KEYID *akid)
-{
-    if (akid && akid->issuer) {
-	int     i;
-	GENERAL_NAMES *gens = akid->issuer;
+    for (i = 0; i < dane->nmemo; ++i) {
+	m = dane->memo + i;
+	if (m->cert == cert && m->selector == selector && m->md == md) {
+	    *data = md ? m->mdbuf : dane->der + m->off;
+	    *len = m->len;
+	    return 1;
+	}
+    }
 
-	for (i = 0; i < sk_GENERAL_NAME_num(gens); ++i) {
-	    GENERAL_NAME *gn = sk_GENERAL_NAME_value(gens, i);
+    if (md) {
+	EVP_MD_CTX *ctx;
 
-	    if (gn->type == GEN_DIRNAME)
-		return (gn->d.dirn);
+	if (!memo_get(dane, cert, selector, 0, &der, &derlen)
+	    || (ctx = md_ctx(dane, md)) == 0
+	    || (m = memo_new(dane, cert, selector, md)) == 0)
+	    return 0;
+	if (!EVP_DigestInit_ex(ctx, md, 0)
+	    || !EVP_DigestUpdate(ctx, der, derlen)
+	    || !EVP_DigestFinal_ex(ctx, m->mdbuf, &m->len)) {
+	    --dane->nmemo;
+	    return 0;
 	}
+	*data = m->mdbuf;
+	*len = m->len;
+	return 1;
     }
-    return 0;
-}
-
-static int set_issuer_name(X509 *cert, AUTHORITY_KEYID *akid)
-{
-    X509_NAME *name = akid_issuer_name(akid);
 
     /*
-     * If subject's akid specifies an authority key identifer issuer name, we
-     * must use that.
+     * Extract ASN.1 DER form of certificate or public key, straight into the
+     * shared encoding buffer.  OpenSSL retains the encoding of the parsed
+     * certificate body and public key, so the length computation is cheap,
+     * and the buffer is only grown when a larger object than any previously
+     * seen is encountered, so the steady-state cost is a single copy.
      */
-    if (name)
-	return X509_set_issuer_name(cert, name);
-    return X509_set_issuer_name(cert, X509_get_subject_name(cert));
-}
-
-static int grow_chain(DANESSL *dane, int trusted, X509 *cert)
-{
-    STACK_OF(X509) **xs = trusted ? &dane->roots : &dane->chain;
-    static ASN1_OBJECT *serverAuth = 0;
-
-#define UNTRUSTED 0
-#define TRUSTED 1
-
-    if (trusted && serverAuth == 0 &&
-       (serverAuth = OBJ_nid2obj(NID_server_auth)) == 0) {
-	DANEerr(DANESSL_F_GROW_CHAIN, ERR_R_MALLOC_FAILURE);
+    switch (selector) {
+    case DANESSL_SELECTOR_CERT:
+	derlen = i2d_X509(cert, NULL);
+	break;
+    case DANESSL_SELECTOR_SPKI:
+	derlen = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), NULL);
+	break;
+    default:
+	derlen = 0;
+	break;
+    }
+    if ((int) derlen <= 0
+	|| (derlen > dane->dermax - dane->derlen && !der_grow(dane, derlen))) {
+	DANEerr(DANESSL_F_MATCH, ERR_R_MALLOC_FAILURE);
 	return 0;
     }
-    if (!*xs && (*xs = sk_X509_new_null()) == 0) {
-	DANEerr(DANESSL_F_GROW_CHAIN, ERR_R_MALLOC_FAILURE);
+    if ((m = memo_new(dane, cert, selector, 0)) == 0)
 	return 0;
+
+    buf = dane->der + dane->derlen;
+    switch (selector) {
+    case DANESSL_SELECTOR_CERT:
+	i2d_X509(cert, &buf);
+	break;
+    case DANESSL_SELECTOR_SPKI:
+	i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), &buf);
+	break;
     }
+    OPENSSL_assert(buf - (dane->der + dane->derlen) == derlen);
 
-    if (cert) {
-	if (trusted && !X509_add1_trust_object(cert, serverAuth))
-	    return 0;
-	X509_up_ref(cert);
-	if (!sk_X509_push(*xs, cert)) {
-	    X509_free(cert);
-	    DANEerr(DANESSL_F_GROW_CHAIN, ERR_R_MALLOC_FAILURE);
-	    return 0;
-	}
-    }
+    m->off = dane->derlen;
+    m->len = derlen;
+    dane->derlen += derlen;
+    *data = dane->der + m->off;
+    *len = derlen;
     return 1;
 }
 
-static int wrap_issuer(
-	DANESSL *dane,
-	EVP_PKEY *key,
-	X509 *subject,
-	int depth,
-	int top
-)
+/*
+ * Compute, in a single pass over the DER form of the certificate or public
+ * key, every not yet memoized digest in "mds".  The DER data is fed to each
+ * digest context a chunk at a time, so that it is read from memory once,
+ * however many digest algorithms appear in the TLSA RRset.
+ */
+static int memo_hash(DANESSL *dane, X509 *cert, uint8_t selector,
+		     const EVP_MD **mds, int n)
 {
-    int ret = 1;
-    X509 *cert = 0;
-    AUTHORITY_KEYID *akid;
-    X509_NAME *name = X509_get_issuer_name(subject);
-    EVP_PKEY *newkey = key ? key : X509_get_pubkey(subject);
+    const EVP_MD *todo[DANE_MAX_MDS];
+    const unsigned char *der;
+    const unsigned char *p;
+    unsigned int derlen;
+    int nmd = 0;
+    int i;
+    int j;
 
-#define WRAP_MID 0		/* Ensure intermediate. */
-#define WRAP_TOP 1		/* Ensure self-signed. */
+    for (i = 0; i < n; ++i) {
+	const unsigned char *data;
+	unsigned int len;
 
-    if (name == 0 || newkey == 0 || (cert = X509_new()) == 0)
-	return 0;
+	if (mds[i] == 0)
+	    continue;
+	for (j = 0; j < dane->nmemo; ++j) {
+	    dane_memo *m = dane->memo + j;
 
-    /*
-     * Record the depth of the trust-anchor certificate.
-     */
-    if (dane->depth < 0)
-	dane->depth = depth + 1;
+	    if (m->cert == cert && m->selector == selector && m->md == mds[i])
+		break;
+	}
+	if (j < dane->nmemo)
+	    continue;
+	if (nmd == DANE_MAX_MDS) {
+	    /* Unusually many digest algorithms, fall back to one at a time */
+	    if (!memo_get(dane, cert, selector, mds[i], &data, &len))
+		return 0;
+	    continue;
+	}
+	todo[nmd++] = mds[i];
+    }
+    if (nmd == 0)
+	return 1;
 
-    /*
-     * XXX: Uncaught error condition:
-     *
-     * The return value is NULL both when the extension is missing, and when
-     * OpenSSL rans out of memory while parsing the extension.
-     */
-    ERR_clear_error();
-    akid = X509_get_ext_d2i(subject, NID_authority_key_identifier, 0, 0);
-    /* XXX: Should we peek at the error stack here??? */
+    if (!memo_get(dane, cert, selector, 0, &der, &derlen))
+	return 0;
 
-    /*
-     * If top is true generate a self-issued root CA, otherwise an
-     * intermediate CA and possibly its self-signed issuer.
-     *
-     * CA cert valid for +/- 30 days
-     */
-    if (!X509_set_version(cert, 2)
-	|| !set_serial(cert, akid, subject)
-	|| !set_issuer_name(cert, akid)
-	|| !X509_gmtime_adj(X509_getm_notBefore(cert), -30 * 86400L)
-	|| !X509_gmtime_adj(X509_getm_notAfter(cert), 30 * 86400L)
-	|| !X509_set_subject_name(cert, name)
-	|| !X509_set_pubkey(cert, newkey)
-	|| !add_ext(0, cert, NID_basic_constraints, "CA:TRUE")
-	|| (!top && !add_akid(cert, akid))
-	|| !add_skid(cert, akid)
-	|| (!top && wrap_to_root &&
-	    !wrap_issuer(dane, newkey, cert, depth, WRAP_TOP))) {
-	ret = 0;
+    for (i = 0; i < nmd; ++i) {
+	if (dane->mdctx[i] == 0 && (dane->mdctx[i] = EVP_MD_CTX_new()) == 0) {
+	    DANEerr(DANESSL_F_MATCH, ERR_R_MALLOC_FAILURE);
+	    return 0;
+	}
+	if (!EVP_DigestInit_ex(dane->mdctx[i], todo[i], 0))
+	    return 0;
     }
-    if (akid)
-	AUTHORITY_KEYID_free(akid);
-    if (!key)
-	EVP_PKEY_free(newkey);
-    if (ret) {
-	if (!top && wrap_to_root)
-	    ret = grow_chain(dane, UNTRUSTED, cert);
-	else
-	    ret = grow_chain(dane, TRUSTED, cert);
+    for (p = der; p < der + derlen; p += DANE_MD_CHUNK) {
+	size_t len = der + derlen - p;
+
+	if (len > DANE_MD_CHUNK)
+	    len = DANE_MD_CHUNK;
+	for (i = 0; i < nmd; ++i)
+	    if (!EVP_DigestUpdate(dane->mdctx[i], p, len))
+		return 0;
     }
-    if (cert)
-	X509_free(cert);
-    return ret;
+    for (i = 0; i < nmd; ++i) {
+	dane_memo *m;
+
+	if ((m = memo_new(dane, cert, selector, todo[i])) == 0)
+	    return 0;
+	if (!EVP_DigestFinal_ex(dane->mdctx[i], m->mdbuf, &m->len)) {
+	    --dane->nmemo;
+	    return 0;
+	}
+    }
+    return 1;
 }
 
-static int wrap_cert(DANESSL *dane, X509 *tacert, int depth)
+/*
+ * Hash every issuer certificate of the peer chain, up front and in one
+ * batch, for each (selector, digest) pair used by either the DANE-TA or
+ * the PKIX-TA records.  Each certificate is then read just once per
+ * selector, even when the two usages call for different digests, and the
+ * matching done by set_trust_anchor() and verify_chain() reduces to memo
+ * lookups.  The leaf is left to match(), since it is only a candidate
+ * trust-anchor when self-issued.
+ */
+static int hash_chain(DANESSL *dane, X509 *leaf, STACK_OF(X509) *chain)
 {
-    if (dane->depth < 0)
-	dane->depth = depth + 1;
-
-    /*
-     * If the TA certificate is self-issued, or need not be, use it directly.
-     * Otherwise, synthesize requisuite ancestors.
-     */
-    if (!wrap_to_root
-	|| X509_check_issued(tacert, tacert) == X509_V_OK)
-	return grow_chain(dane, TRUSTED, tacert);
+    static const int usages[] = {
+	DANESSL_USAGE_DANE_TA, DANESSL_USAGE_PKIX_TA
+    };
+    const EVP_MD *mds[DANESSL_SELECTOR_LAST + 1][DANE_MAX_MDS];
+    int nmd[DANESSL_SELECTOR_LAST + 1];
+    int n = sk_X509_num(chain);
+    int selector;
+    int i;
+    int j;
+    int k;
 
-    if (wrap_issuer(dane, 0, tacert, depth, WRAP_MID))
-	return grow_chain(dane, UNTRUSTED, tacert);
-    return 0;
-}
+    memset(nmd, 0, sizeof(nmd));
+    for (i = 0; i < sizeof(usages) / sizeof(usages[0]); ++i) {
+	dane_table *t = &dane->policy->tables[usages[i]];
 
-static int ta_signed(DANESSL *dane, X509 *cert, int depth)
-{
-    DANE_CERT_LIST x;
-    DANE_PKEY_LIST k;
-    EVP_PKEY *pk;
-    int done = 0;
+	for (j = 0; j < t->ngroups; ++j) {
+	    dane_group *g = t->groups + j;
+	    int s = g->selector;
 
-    /*
-     * First check whether issued and signed by a TA cert, this is cheaper
-     * than the bare-public key checks below, since we can determine whether
-     * the candidate TA certificate issued the certificate to be checked
-     * first (name comparisons), before we bother with signature checks
-     * (public key operations).
-     */
-    for (x = dane->certs; !done && x; x = x->next) {
-	if (X509_check_issued(x->value, cert) == X509_V_OK) {
-	    if ((pk = X509_get_pubkey(x->value)) == 0) {
-		/*
-		 * The cert originally contained a valid pkey, which does
-		 * not just vanish, so this is most likely a memory error.
-		 */
-		done = -1;
-		break;
-	    }
-	    /* Check signature, since some other TA may work if not this. */
-	    if (X509_verify(cert, pk) > 0)
-		done = wrap_cert(dane, x->value, depth) ? 1 : -1;
-	    EVP_PKEY_free(pk);
+	    if (g->md == 0)
+		continue;
+	    for (k = 0; k < nmd[s]; ++k)
+		if (mds[s][k] == g->md)
+		    break;
+	    if (k == nmd[s] && nmd[s] < DANE_MAX_MDS)
+		mds[s][nmd[s]++] = g->md;
 	}
     }
 
-    /*
-     * With bare TA public keys, we can't check whether the trust chain is
-     * issued by the key, but we can determine whether it is signed by the
-     * key, so we go with that.
-     *
-     * Ideally, the corresponding certificate was presented in the chain, and we
-     * matched it by its public key digest one level up.  This code is here
-     * to handle adverse conditions imposed by sloppy administrators of
-     * receiving systems with poorly constructed chains.
-     *
-     * We'd like to optimize out keys that should not match when the cert's
-     * authority key id does not match the key id of this key computed via
-     * the RFC keyid algorithm (SHA-1 digest of public key bit-string sans
-     * ASN1 tag and length thus also excluding the unused bits field that is
-     * logically part of the length).  However, some CAs have a non-standard
-     * authority keyid, so we lose.  Too bad.
-     *
-     * This may push errors onto the stack when the certificate signature is
-     * not of the right type or length, throw these away,
-     */
-    for (k = dane->pkeys; !done && k; k = k->next)
-	if (X509_verify(cert, k->value) > 0)
-	    done = wrap_issuer(dane, k->value, cert, depth, WRAP_MID) ? 1 : -1;
-	else
-	    ERR_clear_error();
+    for (i = 0; i < n; ++i) {
+	X509 *cert = sk_X509_value(chain, i);
 
-    return done;
+	if (cert == leaf)
+	    continue;
+	for (selector = 0; selector <= DANESSL_SELECTOR_LAST; ++selector)
+	    if (nmd[selector]
+		&& !memo_hash(dane, cert, selector, mds[selector],
+			      nmd[selector]))
+		return 0;
+    }
+    return 1;
 }
 
-static int set_trust_anchor(X509_STORE_CTX *ctx, DANESSL *dane, X509 *cert)
+static int match(DANESSL *dane, dane_table *t, X509 *cert, int depth)
 {
     int matched = 0;
-    int n;
     int i;
-    int depth = 0;
-    EVP_PKEY *takey;
-    X509 *ca;
-    STACK_OF(X509) *in = X509_STORE_CTX_get0_untrusted(ctx);
-
-    if (!grow_chain(dane, UNTRUSTED, 0))
-	return -1;
 
     /*
-     * Accept a degenerate case: depth 0 self-signed trust-anchor.
+     * Note, set_trust_anchor() needs to know whether the match was for a
+     * pkey digest or a certificate digest.  We return MATCHED_PKEY or
+     * MATCHED_CERT accordingly.
      */
-    if (X509_check_issued(cert, cert) == X509_V_OK) {
-	dane->depth = 0;
-	matched = match(dane->selectors[DANESSL_USAGE_DANE_TA], cert, 0);
-	if (matched > 0 && !grow_chain(dane, TRUSTED, cert))
-	    matched = -1;
-	return matched;
-    }
-
-    /* Make a shallow copy of the input untrusted chain. */
-    if ((in = sk_X509_dup(in)) == 0) {
-	DANEerr(DANESSL_F_SET_TRUST_ANCHOR, ERR_R_MALLOC_FAILURE);
-	return -1;
-    }
+#define MATCHED_CERT (DANESSL_SELECTOR_CERT + 1)
+#define MATCHED_PKEY (DANESSL_SELECTOR_SPKI + 1)
 
     /*
-     * At each iteration we consume the issuer of the current cert.  This
-     * reduces the length of the "in" chain by one.  If no issuer is found,
-     * we are done.  We also stop when a certificate matches a TA in the
-     * peer's TLSA RRset.
-     *
-     * Caller ensures that the initial certificate is not self-signed.
+     * Loop over each (selector, mtype) group, probing the group's sorted
+     * data for the DER form or digest of the certificate or public key.
+     * The DER form and digests come from the per-verification memo, so
+     * repeated matches of the same certificate cost only the lookups.  On
+     * reaching each new selector, all the digests it needs are computed
+     * together.
      */
-    for (n = sk_X509_num(in); n > 0; --n, ++depth) {
-	for (i = 0; i < n; ++i)
-	    if (X509_check_issued(sk_X509_value(in, i), cert) == X509_V_OK)
-		break;
-
-	/*
-	 * Final untrusted element with no issuer in the peer's chain, it may
-	 * however be signed by a pkey or cert obtained via a TLSA RR.
-	 */
-	if (i == n)
-	    break;
+    for (i = 0; !matched && i < t->ngroups; ++i) {
+	dane_group *g = t->groups + i;
+	const unsigned char *cmpbuf;
+	unsigned int cmplen;
 
-	/* Peer's chain contains an issuer ca. */
-	ca = sk_X509_delete(in, i);
+	if (i == 0 || g[-1].selector != g->selector) {
+	    const EVP_MD *mds[DANE_MAX_MDS];
+	    int n;
 
-	/* If not a trust anchor, record untrusted ca and continue. */
-	if ((matched = match(dane->selectors[DANESSL_USAGE_DANE_TA], ca,
-			     depth + 1)) == 0) {
-	    if (grow_chain(dane, UNTRUSTED, ca)) {
-		if (X509_check_issued(ca, ca) != X509_V_OK) {
-		    /* Restart with issuer as subject */
-		    cert = ca;
-		    continue;
-		}
-		/* Final self-signed element, skip ta_signed() check. */
-		cert = 0;
-	    } else
-		matched = -1;
-	} else if (matched == MATCHED_CERT) {
-	    if (!wrap_cert(dane, ca, depth))
-		matched = -1;
-	} else if (matched == MATCHED_PKEY) {
-	    if ((takey = X509_get_pubkey(ca)) == 0 ||
-		!wrap_issuer(dane, takey, cert, depth, WRAP_MID)) {
-		if (takey)
-		    EVP_PKEY_free(takey);
-		else
-		    DANEerr(DANESSL_F_SET_TRUST_ANCHOR, ERR_R_MALLOC_FAILURE);
-		matched = -1;
+	    for (n = 0; i + n < t->ngroups && n < DANE_MAX_MDS; ++n) {
+		if (g[n].selector != g->selector)
+		    break;
+		mds[n] = g[n].md;
 	    }
+	    if (!memo_hash(dane, cert, g->selector, mds, n))
+		return -1;
 	}
-	break;
+	if (!memo_get(dane, cert, g->selector, g->md, &cmpbuf, &cmplen))
+	    return -1;
+	if (group_find(g, cmpbuf, cmplen, 0))
+	    matched = g->selector + 1;
     }
 
-    /* Shallow free the duplicated input untrusted chain. */
-    sk_X509_free(in);
+    return matched;
+}
+
+/*
+ * The extensions of synthetic certificates are built from DER templates,
+ * with just the key identifier bytes filled in.  Key identifiers longer
+ * than this are left to the ASN.1 encoder.
+ */
+#define DANE_KEYID_MAX	127	/* Short-form DER length */
+
+static const unsigned char basic_ca_der[] = {
+    0x30, 0x03,			/* SEQUENCE, BasicConstraints */
+    0x01, 0x01, 0xff		/*   BOOLEAN, cA TRUE */
+};
+
+static int push_ext(X509 *cert, int nid, const unsigned char *der, int len)
+{
+    ASN1_OCTET_STRING *value;
+    X509_EXTENSION *ext = 0;
+    int ret = 0;
+
+    if ((value = ASN1_OCTET_STRING_new()) != 0
+	&& ASN1_OCTET_STRING_set(value, der, len)
+	&& (ext = X509_EXTENSION_create_by_NID(0, nid, 0, value)) != 0
+	&& X509_add_ext(cert, ext, -1))
+	ret = 1;
+    if (ext)
+	X509_EXTENSION_free(ext);
+    if (value)
+	ASN1_OCTET_STRING_free(value);
+    if (!ret)
+	DANEerr(DANESSL_F_PUSH_EXT, ERR_R_MALLOC_FAILURE);
+    return ret;
+}
+
+static int set_serial(X509 *cert, AUTHORITY_KEYID *akid, X509 *subject)
+{
+    int ret = 0;
+    BIGNUM *bn;
+
+    if (akid && akid->serial)
+	return (X509_set_serialNumber(cert, akid->serial));
 
     /*
-     * When the loop exits, if "cert" is set, it is not self-signed and has
-     * no issuer in the chain, we check for a possible signature via a DNS
-     * obtained TA cert or public key.
+     * Add one to subject's serial to avoid collisions between TA serial and
+     * serial of signing root.
      */
-    if (matched == 0 && cert)
-	 matched = ta_signed(dane, cert, depth);
+    if ((bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(subject), 0)) != 0
+	&& BN_add_word(bn, 1)
+	&& BN_to_ASN1_INTEGER(bn, X509_get_serialNumber(cert)))
+	ret = 1;
 
-    return matched;
+    if (bn)
+	BN_free(bn);
+    return ret;
 }
 
-static int check_end_entity(X509_STORE_CTX *ctx, DANESSL *dane, X509 *cert)
+static int add_akid(X509 *cert, AUTHORITY_KEYID *akid)
 {
-    int matched;
+    ASN1_OCTET_STRING *id;
+    unsigned char der[] = {
+	0x30, 0x03,		/* SEQUENCE, AuthorityKeyIdentifier */
+	0x80, 0x01, 0x00	/*   [0] keyIdentifier */
+    };
 
-    matched = match(dane->selectors[DANESSL_USAGE_DANE_EE], cert, 0);
-    if (matched > 0) {
-	dane->mdpth = 0;
-	dane->match = cert;
-	X509_up_ref(cert);
-	if (X509_STORE_CTX_get0_chain(ctx) == 0) {
-	    STACK_OF(X509) *chain = sk_X509_new_null();
+    /*
+     * 0 will never be our subject keyid from a SHA-1 hash, but it could be
+     * our subject keyid if forced from child's akid.  If so, set our
+     * authority keyid to 1.  This way we are never self-signed, and thus
+     * exempt from any potential (off by default for now in OpenSSL)
+     * self-signature checks!
+     */
+    id =  (akid && akid->keyid) ? akid->keyid : 0;
+    if (id && ASN1_STRING_length(id) == 1 && *ASN1_STRING_get0_data(id) == 0)
+	der[4] = 1;
 
-	    if (chain && sk_X509_push(chain, cert)) {
-		X509_up_ref(cert);
-		X509_STORE_CTX_set0_verified_chain(ctx, chain);
-	    } else {
-                if (chain)
-                    sk_X509_free(chain);
-		DANEerr(DANESSL_F_CHECK_END_ENTITY, ERR_R_MALLOC_FAILURE);
-		return -1;
-	    }
+    return push_ext(cert, NID_authority_key_identifier, der, sizeof(der));
+}
+
+static int add_skid(X509 *cert, AUTHORITY_KEYID *akid)
+{
+    int nid = NID_subject_key_identifier;
+    unsigned char der[2 + DANE_KEYID_MAX];
+    unsigned int len;
+
+    /*
+     * Use the child's authority keyid if any, else the RFC 5280 keyid: the
+     * SHA-1 digest of the public key bit-string.
+     */
+    if (akid && akid->keyid) {
+	len = ASN1_STRING_length(akid->keyid);
+	if (len > DANE_KEYID_MAX)
+	    return X509_add1_ext_i2d(cert, nid, akid->keyid, 0,
+				     X509V3_ADD_APPEND) > 0;
+	memcpy(der + 2, ASN1_STRING_get0_data(akid->keyid), len);
+    } else if (!X509_pubkey_digest(cert, EVP_sha1(), der + 2, &len)) {
+	DANEerr(DANESSL_F_ADD_SKID, ERR_R_MALLOC_FAILURE);
+	return 0;
+    }
+    der[0] = V_ASN1_OCTET_STRING;
+    der[1] = len;
+    return push_ext(cert, nid, der, 2 + len);
+}
+
+static X509_NAME *akid_issuer_name(AUTHORITY_KEYID *akid)
+{
+    if (akid && akid->issuer) {
+	int     i;
+	GENERAL_NAMES *gens = akid->issuer;
+
+	for (i = 0; i < sk_GENERAL_NAME_num(gens); ++i) {
+	    GENERAL_NAME *gn = sk_GENERAL_NAME_value(gens, i);
+
+	    if (gn->type == GEN_DIRNAME)
+		return (gn->d.dirn);
+	}
+    }
+    return 0;
+}
+
+static int set_issuer_name(X509 *cert, AUTHORITY_KEYID *akid)
+{
+    X509_NAME *name = akid_issuer_name(akid);
+
+    /*
+     * If subject's akid specifies an authority key identifer issuer name, we
+     * must use that.
+     */
+    if (name)
+	return X509_set_issuer_name(cert, name);
+    return X509_set_issuer_name(cert, X509_get_subject_name(cert));
+}
+
+static int grow_chain(DANESSL *dane, int trusted, X509 *cert)
+{
+    STACK_OF(X509) **xs = trusted ? &dane->roots : &dane->chain;
+
+#define UNTRUSTED 0
+#define TRUSTED 1
+
+    if (!*xs && (*xs = sk_X509_new_null()) == 0) {
+	DANEerr(DANESSL_F_GROW_CHAIN, ERR_R_MALLOC_FAILURE);
+	return 0;
+    }
+
+    if (cert) {
+	/*
+	 * Trust-anchor certificates from a shared policy may be in use by
+	 * other threads, so only modify certificates not yet trusted.
+	 */
+	if (trusted
+	    && X509_check_trust(cert, X509_TRUST_SSL_SERVER, 0)
+		!= X509_TRUST_TRUSTED
+	    && !X509_add1_trust_object(cert, server_auth))
+	    return 0;
+	X509_up_ref(cert);
+	if (!sk_X509_push(*xs, cert)) {
+	    X509_free(cert);
+	    DANEerr(DANESSL_F_GROW_CHAIN, ERR_R_MALLOC_FAILURE);
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+#define WRAP_MID 0		/* Ensure intermediate. */
+#define WRAP_TOP 1		/* Ensure self-signed. */
+
+/*
+ * Build the synthetic issuer of "subject", with public key "key".  Unless
+ * "top" is true, and wrap_to_root is in effect, the result is an
+ * intermediate CA, and its self-issued root is returned via "root".
+ * Trusted certificates are marked as such, and extensions cached, so that
+ * the result is not modified when shared by multiple connections.
+ */
+static X509 *wrap_build(EVP_PKEY *key, X509 *subject, int top, X509 **root)
+{
+    X509 *cert = 0;
+    AUTHORITY_KEYID *akid;
+    X509_NAME *name = X509_get_issuer_name(subject);
+    int trusted = top || !wrap_to_root;
+    int ok;
+
+    if (name == 0 || (cert = X509_new()) == 0)
+	return 0;
+
+    /*
+     * XXX: Uncaught error condition:
+     *
+     * The return value is NULL both when the extension is missing, and when
+     * OpenSSL rans out of memory while parsing the extension.
+     */
+    ERR_clear_error();
+    akid = X509_get_ext_d2i(subject, NID_authority_key_identifier, 0, 0);
+    /* XXX: Should we peek at the error stack here??? */
+
+    /*
+     * If top is true generate a self-issued root CA, otherwise an
+     * intermediate CA and possibly its self-signed issuer.
+     *
+     * CA cert valid for +/- 30 days
+     */
+    ok = X509_set_version(cert, 2)
+	&& set_serial(cert, akid, subject)
+	&& set_issuer_name(cert, akid)
+	&& X509_gmtime_adj(X509_getm_notBefore(cert), -30 * 86400L)
+	&& X509_gmtime_adj(X509_getm_notAfter(cert), 30 * 86400L)
+	&& X509_set_subject_name(cert, name)
+	&& X509_set_pubkey(cert, key)
+	&& push_ext(cert, NID_basic_constraints, basic_ca_der,
+		    sizeof(basic_ca_der))
+	&& (top || add_akid(cert, akid))
+	&& add_skid(cert, akid)
+	&& (trusted ? X509_add1_trust_object(cert, server_auth)
+	    : (*root = wrap_build(key, cert, WRAP_TOP, 0)) != 0);
+
+    if (akid)
+	AUTHORITY_KEYID_free(akid);
+    if (!ok) {
+	X509_free(cert);
+	return 0;
+    }
+    (void) X509_check_purpose(cert, -1, 0);
+    return cert;
+}
+
+/*
+ * Synthetic issuers are the same for every connection to the same server,
+ * so they are cached across connections, in a small direct-mapped table,
+ * keyed by a SHA-256 digest of all the inputs of wrap_build().  Entries are
+ * replaced after a day, well within the certificate validity period.
+ */
+#define DANE_WRAP_SLOTS	64
+#define DANE_WRAP_TTL	86400
+
+typedef struct dane_wrap {
+    unsigned char id[EVP_MAX_MD_SIZE];
+    time_t	  expires;
+    X509	  *cert;
+    X509	  *root;
+} dane_wrap;
+
+static dane_wrap wrap_cache[DANE_WRAP_SLOTS];
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define wrap_lock() CRYPTO_w_lock(CRYPTO_LOCK_SSL_SESSION)
+#define wrap_unlock() CRYPTO_w_unlock(CRYPTO_LOCK_SSL_SESSION)
+#else
+static CRYPTO_RWLOCK *wrap_rwlock;
+#define wrap_lock() CRYPTO_THREAD_write_lock(wrap_rwlock)
+#define wrap_unlock() CRYPTO_THREAD_unlock(wrap_rwlock)
+#endif
+
+static int wrap_id(
+	DANESSL *dane,
+	EVP_PKEY *key,
+	X509 *subject,
+	int top,
+	unsigned char *id
+)
+{
+    const EVP_MD *md = mtype_md[DANESSL_MATCHING_2256];
+    X509_NAME *name = X509_get_issuer_name(subject);
+    ASN1_INTEGER *serial = X509_get_serialNumber(subject);
+    int i = X509_get_ext_by_NID(subject, NID_authority_key_identifier, -1);
+    ASN1_OCTET_STRING *akid = 0;
+    EVP_MD_CTX *ctx;
+    unsigned char *spki;
+    unsigned char *nbuf;
+    unsigned char *buf;
+    unsigned char flags[2];
+    int slen;
+    int nlen;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    if (wrap_rwlock == 0)
+	return 0;
+#endif
+    if (md == 0 || name == 0 || serial == 0)
+	return 0;
+    if ((ctx = md_ctx(dane, md)) == 0)
+	return 0;
+
+    if (i >= 0)
+	akid = X509_EXTENSION_get_data(X509_get_ext(subject, i));
+    flags[0] = top;
+    flags[1] = akid != 0;
+
+    /*
+     * Encode the key and issuer name into the free tail of the handle's
+     * encoding buffer, which the memo does not own, so no scratch memory
+     * is allocated once the buffer has grown large enough.
+     */
+    if ((slen = i2d_PUBKEY(key, 0)) <= 0
+	|| (nlen = i2d_X509_NAME(name, 0)) <= 0
+	|| ((size_t) slen + nlen > dane->dermax - dane->derlen
+	    && !der_grow(dane, (size_t) slen + nlen)))
+	return 0;
+    spki = buf = dane->der + dane->derlen;
+    nbuf = spki + slen;
+    if (i2d_PUBKEY(key, &buf) != slen || i2d_X509_NAME(name, &buf) != nlen)
+	return 0;
+    return EVP_DigestInit_ex(ctx, md, 0)
+	&& EVP_DigestUpdate(ctx, flags, sizeof(flags))
+	&& EVP_DigestUpdate(ctx, spki, slen)
+	&& EVP_DigestUpdate(ctx, nbuf, nlen)
+	&& EVP_DigestUpdate(ctx, ASN1_STRING_get0_data(serial),
+			    ASN1_STRING_length(serial))
+	&& (akid == 0
+	    || EVP_DigestUpdate(ctx, ASN1_STRING_get0_data(akid),
+				ASN1_STRING_length(akid)))
+	&& EVP_DigestFinal_ex(ctx, id, 0);
+}
+
+static int wrap_get(const unsigned char *id, X509 **cert, X509 **root)
+{
+    dane_wrap *w = &wrap_cache[id[0] % DANE_WRAP_SLOTS];
+    int found = 0;
+
+    wrap_lock();
+    if (w->cert && w->expires > time(0)
+	&& memcmp(w->id, id, SHA256_DIGEST_LENGTH) == 0) {
+	*cert = w->cert;
+	*root = w->root;
+	X509_up_ref(*cert);
+	if (*root)
+	    X509_up_ref(*root);
+	found = 1;
+    }
+    wrap_unlock();
+    return found;
+}
+
+static void wrap_put(const unsigned char *id, X509 *cert, X509 *root)
+{
+    dane_wrap *w = &wrap_cache[id[0] % DANE_WRAP_SLOTS];
+    X509 *oldcert;
+    X509 *oldroot;
+
+    X509_up_ref(cert);
+    if (root)
+	X509_up_ref(root);
+
+    wrap_lock();
+    oldcert = w->cert;
+    oldroot = w->root;
+    memcpy(w->id, id, SHA256_DIGEST_LENGTH);
+    w->expires = time(0) + DANE_WRAP_TTL;
+    w->cert = cert;
+    w->root = root;
+    wrap_unlock();
+
+    if (oldcert)
+	X509_free(oldcert);
+    if (oldroot)
+	X509_free(oldroot);
+}
+
+static int wrap_issuer(
+	DANESSL *dane,
+	EVP_PKEY *key,
+	X509 *subject,
+	int depth,
+	int top
+)
+{
+    int ret = 0;
+    int cached;
+    X509 *cert = 0;
+    X509 *root = 0;
+    unsigned char id[EVP_MAX_MD_SIZE];
+    EVP_PKEY *newkey = key ? key : X509_get_pubkey(subject);
+
+    if (newkey == 0)
+	return 0;
+
+    /*
+     * Record the depth of the trust-anchor certificate.
+     */
+    if (dane->depth < 0)
+	dane->depth = depth + 1;
+
+    cached = wrap_id(dane, newkey, subject, top, id);
+    if (!cached || !wrap_get(id, &cert, &root)) {
+	if ((cert = wrap_build(newkey, subject, top, &root)) != 0 && cached)
+	    wrap_put(id, cert, root);
+    }
+    if (!key)
+	EVP_PKEY_free(newkey);
+
+    /* With a synthetic root, the intermediate is not itself trusted */
+    if (cert)
+	ret = (root == 0 || grow_chain(dane, TRUSTED, root))
+	    && grow_chain(dane, root ? UNTRUSTED : TRUSTED, cert);
+    if (cert)
+	X509_free(cert);
+    if (root)
+	X509_free(root);
+    return ret;
+}
+
+static int wrap_cert(DANESSL *dane, X509 *tacert, int depth)
+{
+    if (dane->depth < 0)
+	dane->depth = depth + 1;
+
+    /*
+     * If the TA certificate is self-issued, or need not be, use it directly.
+     * Otherwise, synthesize requisuite ancestors.
+     */
+    if (!wrap_to_root
+	|| X509_check_issued(tacert, tacert) == X509_V_OK)
+	return grow_chain(dane, TRUSTED, tacert);
+
+    if (wrap_issuer(dane, 0, tacert, depth, WRAP_MID))
+	return grow_chain(dane, UNTRUSTED, tacert);
+    return 0;
+}
+
+/*
+ * Can a key of the given type have produced a signature with a public key
+ * algorithm of "pknid"?  Unknown algorithms can't be ruled out.
+ */
+static int key_can_sign(int type, int pknid)
+{
+    if (pknid == NID_undef || type == pknid)
+	return 1;
+#ifdef NID_rsassaPss
+    if (pknid == NID_rsassaPss && type == EVP_PKEY_RSA)
+	return 1;
+#endif
+    return 0;
+}
+
+/*
+ * Try a bare TA public key as the signer of "cert", skipping keys of the
+ * wrong type for the signature algorithm.
+ */
+static int ta_key_signed(DANESSL *dane, dane_ta_key *t, X509 *cert,
+			 int pknid, int depth)
+{
+    if (!key_can_sign(t->type, pknid))
+	return 0;
+    if (X509_verify(cert, t->pkey) > 0)
+	return wrap_issuer(dane, t->pkey, cert, depth, WRAP_MID) ? 1 : -1;
+    ERR_clear_error();
+    return 0;
+}
+
+static int ta_signed(DANESSL *dane, X509 *cert, int depth)
+{
+    DANESSL_POLICY *pol = dane->policy;
+    const ASN1_OCTET_STRING *akid = X509_get0_authority_key_id(cert);
+    const unsigned char *keyid = 0;
+    EVP_PKEY *pk;
+    int pknid = NID_undef;
+    int done = 0;
+    int lo;
+    int hi;
+
+    /*
+     * First check whether issued and signed by a TA cert, this is cheaper
+     * than the bare-public key checks below, since we can determine whether
+     * the candidate TA certificate issued the certificate to be checked
+     * first (name comparisons), before we bother with signature checks
+     * (public key operations).  Only certificates whose subject name has
+     * the right hash, and whose keyid, if any, matches the authority keyid,
+     * if any, can be the issuer.
+     */
+    if (pol->ntacerts > 0) {
+	unsigned long hash = X509_NAME_hash(X509_get_issuer_name(cert));
+
+	for (lo = 0, hi = pol->ntacerts; lo < hi; /* NOP */) {
+	    int mid = (lo + hi) / 2;
+
+	    if (pol->tacerts[mid].hash < hash)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	for (/* NOP */; !done && lo < pol->ntacerts; ++lo) {
+	    dane_ta_cert *t = &pol->tacerts[lo];
+
+	    if (t->hash != hash)
+		break;
+	    if (akid && t->skid && ASN1_OCTET_STRING_cmp(akid, t->skid) != 0)
+		continue;
+	    if (X509_check_issued(t->cert, cert) != X509_V_OK)
+		continue;
+	    if ((pk = X509_get_pubkey(t->cert)) == 0) {
+		/*
+		 * The cert originally contained a valid pkey, which does
+		 * not just vanish, so this is most likely a memory error.
+		 */
+		done = -1;
+		break;
+	    }
+	    /* Check signature, since some other TA may work if not this. */
+	    if (X509_verify(cert, pk) > 0)
+		done = wrap_cert(dane, t->cert, depth) ? 1 : -1;
+	    EVP_PKEY_free(pk);
+	}
+    }
+    if (done || pol->ntakeys == 0)
+	return done;
+
+    /*
+     * With bare TA public keys, we can't check whether the trust chain is
+     * issued by the key, but we can determine whether it is signed by the
+     * key, so we go with that.
+     *
+     * Ideally, the corresponding certificate was presented in the chain, and we
+     * matched it by its public key digest one level up.  This code is here
+     * to handle adverse conditions imposed by sloppy administrators of
+     * receiving systems with poorly constructed chains.
+     *
+     * When the cert's authority key id has the length of an RFC 5280 keyid
+     * (SHA-1 digest of public key bit-string sans ASN1 tag and length thus
+     * also excluding the unused bits field that is logically part of the
+     * length), keys with that keyid are tried first.  Since nothing obliges
+     * a CA to use RFC 5280 keyids, even of that length, the remaining keys
+     * are then tried, as are all the keys when the authority keyid has
+     * some other length or is absent.  Either way, keys of the wrong type
+     * for the signature algorithm are skipped.
+     *
+     * This may push errors onto the stack when the certificate signature is
+     * not of the right type or length, throw these away,
+     */
+    (void) OBJ_find_sigid_algs(X509_get_signature_nid(cert), 0, &pknid);
+    if (akid && ASN1_STRING_length(akid) == SHA_DIGEST_LENGTH) {
+	keyid = ASN1_STRING_get0_data(akid);
+	for (lo = 0, hi = pol->ntakeys; lo < hi; /* NOP */) {
+	    int mid = (lo + hi) / 2;
+
+	    if (memcmp(pol->takeys[mid].keyid, keyid, SHA_DIGEST_LENGTH) < 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	for (/* NOP */; !done && lo < pol->ntakeys; ++lo) {
+	    dane_ta_key *t = &pol->takeys[lo];
+
+	    if (memcmp(t->keyid, keyid, SHA_DIGEST_LENGTH) != 0)
+		break;
+	    done = ta_key_signed(dane, t, cert, pknid, depth);
+	}
+    }
+    for (lo = 0; !done && lo < pol->ntakeys; ++lo) {
+	dane_ta_key *t = &pol->takeys[lo];
+
+	/* Skip keys already tried above */
+	if (keyid && memcmp(t->keyid, keyid, SHA_DIGEST_LENGTH) == 0)
+	    continue;
+	done = ta_key_signed(dane, t, cert, pknid, depth);
+    }
+
+    return done;
+}
+
+static int issuer_cmp(const void *a, const void *b)
+{
+    const dane_issuer *x = a;
+    const dane_issuer *y = b;
+
+    if (x->hash != y->hash)
+	return x->hash < y->hash ? -1 : 1;
+    return x->pos - y->pos;
+}
+
+/*
+ * Index the peer's untrusted chain, computing each subject name hash once.
+ * Returns the number of entries or -1 on error.
+ */
+static int issuer_index(DANESSL *dane, STACK_OF(X509) *in)
+{
+    int n = sk_X509_num(in);
+    int i;
+
+    if (n > dane->missuers) {
+	dane_issuer *tmp;
+
+	if ((tmp = OPENSSL_realloc(dane->issuers, n * sizeof(*tmp))) == 0) {
+	    DANEerr(DANESSL_F_SET_TRUST_ANCHOR, ERR_R_MALLOC_FAILURE);
+	    return -1;
+	}
+	dane->issuers = tmp;
+	dane->missuers = n;
+    }
+    for (i = 0; i < n; ++i) {
+	dane_issuer *e = &dane->issuers[i];
+
+	e->cert = sk_X509_value(in, i);
+	e->hash = X509_NAME_hash(X509_get_subject_name(e->cert));
+	e->skid = X509_get0_subject_key_id(e->cert);
+	e->pos = i;
+	e->used = 0;
+    }
+    if (n > 1)
+	qsort(dane->issuers, n, sizeof(*dane->issuers), issuer_cmp);
+    return n;
+}
+
+/*
+ * Find and consume the first not yet used issuer of "cert" in the index.
+ * Only certificates with the right subject name hash, and a key identifier
+ * consistent with the authority key identifier of "cert", are checked with
+ * X509_check_issued().
+ */
+static X509 *issuer_find(DANESSL *dane, int n, X509 *cert)
+{
+    unsigned long hash = X509_NAME_hash(X509_get_issuer_name(cert));
+    const ASN1_OCTET_STRING *akid = X509_get0_authority_key_id(cert);
+    int lo = 0;
+    int hi = n;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+
+	if (dane->issuers[mid].hash < hash)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (/* NOP */; lo < n && dane->issuers[lo].hash == hash; ++lo) {
+	dane_issuer *e = &dane->issuers[lo];
+
+	if (e->used)
+	    continue;
+	if (akid && e->skid && ASN1_OCTET_STRING_cmp(akid, e->skid) != 0)
+	    continue;
+	if (X509_check_issued(e->cert, cert) == X509_V_OK) {
+	    e->used = 1;
+	    return e->cert;
+	}
+    }
+    return 0;
+}
+
+static int set_trust_anchor(X509_STORE_CTX *ctx, DANESSL *dane, X509 *cert)
+{
+    int matched = 0;
+    int n;
+    int nindex;
+    int depth = 0;
+    EVP_PKEY *takey;
+    X509 *ca;
+
+    if (!grow_chain(dane, UNTRUSTED, 0))
+	return -1;
+
+    /*
+     * Accept a degenerate case: depth 0 self-signed trust-anchor.
+     */
+    if (X509_check_issued(cert, cert) == X509_V_OK) {
+	dane->depth = 0;
+	matched = match(dane, &dane->policy->tables[DANESSL_USAGE_DANE_TA],
+			cert, 0);
+	if (matched > 0 && !grow_chain(dane, TRUSTED, cert))
+	    matched = -1;
+	return matched;
+    }
+
+    if ((nindex = issuer_index(dane, X509_STORE_CTX_get0_untrusted(ctx))) < 0)
+	return -1;
+
+    /*
+     * At each iteration we consume the issuer of the current cert.  This
+     * reduces the number of unused index entries by one.  If no issuer is
+     * found, we are done.  We also stop when a certificate matches a TA in
+     * the peer's TLSA RRset.
+     *
+     * Caller ensures that the initial certificate is not self-signed.
+     */
+    for (n = nindex; n > 0; --n, ++depth) {
+	/*
+	 * Final untrusted element with no issuer in the peer's chain, it may
+	 * however be signed by a pkey or cert obtained via a TLSA RR.
+	 */
+	if ((ca = issuer_find(dane, nindex, cert)) == 0)
+	    break;
+
+	/* Peer's chain contains an issuer ca. */
+
+	/* If not a trust anchor, record untrusted ca and continue. */
+	matched = match(dane, &dane->policy->tables[DANESSL_USAGE_DANE_TA], ca,
+			depth + 1);
+	if (matched == 0) {
+	    if (grow_chain(dane, UNTRUSTED, ca)) {
+		if (X509_check_issued(ca, ca) != X509_V_OK) {
+		    /* Restart with issuer as subject */
+		    cert = ca;
+		    continue;
+		}
+		/* Final self-signed element, skip ta_signed() check. */
+		cert = 0;
+	    } else
+		matched = -1;
+	} else if (matched == MATCHED_CERT) {
+	    if (!wrap_cert(dane, ca, depth))
+		matched = -1;
+	} else if (matched == MATCHED_PKEY) {
+	    if ((takey = X509_get_pubkey(ca)) == 0 ||
+		!wrap_issuer(dane, takey, cert, depth, WRAP_MID)) {
+		if (takey)
+		    EVP_PKEY_free(takey);
+		else
+		    DANEerr(DANESSL_F_SET_TRUST_ANCHOR, ERR_R_MALLOC_FAILURE);
+		matched = -1;
+	    }
+	}
+	break;
+    }
+
+    /*
+     * When the loop exits, if "cert" is set, it is not self-signed and has
+     * no issuer in the chain, we check for a possible signature via a DNS
+     * obtained TA cert or public key.
+     */
+    if (matched == 0 && cert)
+	 matched = ta_signed(dane, cert, depth);
+
+    return matched;
+}
+
+static int check_end_entity(X509_STORE_CTX *ctx, DANESSL *dane, X509 *cert)
+{
+    int matched;
+
+    matched = match(dane, &dane->policy->tables[DANESSL_USAGE_DANE_EE],
+		    cert, 0);
+    if (matched > 0) {
+	dane->mdpth = 0;
+	dane->match = cert;
+	X509_up_ref(cert);
+	if (X509_STORE_CTX_get0_chain(ctx) == 0) {
+	    STACK_OF(X509) *chain = sk_X509_new_null();
+
+	    if (chain && sk_X509_push(chain, cert)) {
+		X509_up_ref(cert);
+		X509_STORE_CTX_set0_verified_chain(ctx, chain);
+	    } else {
+                if (chain)
+                    sk_X509_free(chain);
+		DANEerr(DANESSL_F_CHECK_END_ENTITY, ERR_R_MALLOC_FAILURE);
+		return -1;
+	    }
+	}
+    }
+    return matched;
+}
+
+/*
+ * Copy the "len" byte name "name" to "out" in lower case, NUL-terminated,
+ * and return true if every byte is a letter, digit, '-', '.' or '*'.  Any
+ * NUL or 8-bit byte fails the check.  The copy is made either way, so the
+ * same pass serves to validate certificate names and just case-fold the
+ * reference names.  With SSE2, sixteen bytes at a time are classified with
+ * signed range compares, which also exclude the (negative) 8-bit bytes.
+ */
+static int name_fold(const char *name, size_t len, char *out)
+{
+    size_t i = 0;
+    int ok = 1;
+
+#if defined(__SSE2__)
+#define RANGE(c, lo, hi) _mm_and_si128( \
+	_mm_cmpgt_epi8((c), _mm_set1_epi8((lo) - 1)), \
+	_mm_cmplt_epi8((c), _mm_set1_epi8((hi) + 1)))
+#define BYTE(c, b) _mm_cmpeq_epi8((c), _mm_set1_epi8(b))
+
+    for (/* NOP */; i + 16 <= len; i += 16) {
+	__m128i c = _mm_loadu_si128((const __m128i *) (name + i));
+	__m128i upper = RANGE(c, 'A', 'Z');
+	__m128i valid = _mm_or_si128(
+	    _mm_or_si128(upper, RANGE(c, 'a', 'z')),
+	    _mm_or_si128(RANGE(c, '0', '9'),
+			 _mm_or_si128(_mm_or_si128(BYTE(c, '.'), BYTE(c, '-')),
+				      BYTE(c, '*'))));
+
+	ok &= _mm_movemask_epi8(valid) == 0xffff;
+	c = _mm_or_si128(c, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+	_mm_storeu_si128((__m128i *) (out + i), c);
+    }
+#undef RANGE
+#undef BYTE
+#endif
+
+    for (/* NOP */; i < len; ++i) {
+	char c = name[i];
+
+	if (c >= 'A' && c <= 'Z')
+	    c += 'a' - 'A';
+	else if (!((c >= 'a' && c <= 'z') ||
+		   (c >= '0' && c <= '9') ||
+		   (c == '.' || c == '-') ||
+		   (c == '*')))
+	    ok = 0;
+	out[i] = c;
+    }
+    out[len] = '\0';
+    return ok;
+}
+
+/*
+ * Store the key of the "len" byte lower case name "name" in "key", and
+ * return its length.  Labels are copied last to first.
+ */
+static size_t name_key(const char *name, size_t len, char *key)
+{
+    const char *end = name + len;
+    char *k = key;
+
+    for (;;) {
+	const char *label = end;
+
+	while (label > name && label[-1] != '.')
+	    --label;
+	memcpy(k, label, end - label);
+	k += end - label;
+	if (label == name)
+	    break;
+	*k++ = '.';
+	end = label - 1;
+    }
+    *k = '\0';
+    return k - key;
+}
+
+static int name_cmp(const dane_name *n, const char *key, size_t len)
+{
+    int cmp = memcmp(n->key, key, n->len < len ? n->len : len);
+
+    if (cmp != 0 || n->len == len)
+	return cmp;
+    return n->len < len ? -1 : 1;
+}
+
+static int name_sort(const void *a, const void *b)
+{
+    const dane_name *x = a;
+    const dane_name *y = b;
+
+    return name_cmp(x, y->key, y->len);
+}
+
+/*
+ * FNV-1a, which being incremental lets match_name() hash each prefix of a
+ * key on its way to the end.
+ */
+#define NAME_HASH_INIT 2166136261U
+#define NAME_HASH_STEP(h, c) (((h) ^ (unsigned char) (c)) * 16777619U)
+
+static uint32_t name_hash(const char *key, size_t len)
+{
+    uint32_t h = NAME_HASH_INIT;
+
+    while (len-- > 0)
+	h = NAME_HASH_STEP(h, *key++);
+    return h;
+}
+
+/*
+ * Is the key, with the given hash, in the table, or, with "prefix", any key
+ * that starts with it?
+ */
+static int names_find(const dane_nametab *t, const char *key, size_t len,
+		      uint32_t hash, int prefix)
+{
+    const dane_name *tab = t->tab;
+    int lo = 0;
+    int hi = t->n;
+
+    if (t->slots && !prefix) {
+	size_t i;
+
+	for (i = hash & t->mask; (lo = t->slots[i]) >= 0;
+	     i = (i + 1) & t->mask)
+	    if (tab[lo].len == len && memcmp(tab[lo].key, key, len) == 0)
+		return 1;
+	return 0;
+    }
+
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+
+	if (name_cmp(tab + mid, key, len) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == t->n || tab[lo].len < len || memcmp(tab[lo].key, key, len) != 0)
+	return 0;
+    return prefix || tab[lo].len == len;
+}
+
+/*
+ * Sort a table and drop duplicates, then index large tables by hash, with
+ * at most half of the slots in use.
+ */
+static int names_sort(dane_arena *a, dane_nametab *t)
+{
+    dane_name *tab = t->tab;
+    size_t size;
+    int i;
+    int j;
+
+    if (t->n < 2)
+	return 1;
+    qsort(tab, t->n, sizeof(*tab), name_sort);
+    for (i = j = 1; i < t->n; ++i)
+	if (name_cmp(tab + j - 1, tab[i].key, tab[i].len) != 0)
+	    tab[j++] = tab[i];
+    if ((t->n = j) < DANE_NAMES_HASH)
+	return 1;
+
+    for (size = 2 * DANE_NAMES_HASH; size < 2 * (size_t) t->n; size <<= 1)
+	/* NOP */;
+    if ((t->slots = arena_alloc(a, size * sizeof(int))) == 0)
+	return 0;
+    memset(t->slots, 0xff, size * sizeof(int));
+    t->mask = size - 1;
+    for (i = 0; i < t->n; ++i) {
+	size_t k = name_hash(tab[i].key, tab[i].len) & t->mask;
+
+	while (t->slots[k] >= 0)
+	    k = (k + 1) & t->mask;
+	t->slots[k] = i;
+    }
+    return 1;
+}
+
+static int names_init(dane_arena *a, dane_names *names, const char **src)
+{
+    size_t n;
+
+    memset(names, 0, sizeof(*names));
+    for (n = 0; src[n]; ++n)
+	/* NOP */;
+    if (n == 0)
+	return 1;
+    if (n > INT_MAX / 3
+	|| (names->exact.tab = arena_alloc(a, 3 * n * sizeof(dane_name))) == 0)
+	return 0;
+    names->parents.tab = names->exact.tab + n;
+    names->subdomains.tab = names->parents.tab + n;
+
+    for (/* NOP */; *src; ++src) {
+	const char *name = *src;
+	size_t len = strlen(name);
+	int subdomain = 0;
+	char lower[DANE_NAME_MAX + 1];
+	dane_name *e;
+	char *key;
+
+	if (*name == '.' && name[1] != '\0') {
+	    ++name;
+	    --len;
+	    subdomain = 1;
+	}
+	if (len > DANE_NAME_MAX)
+	    continue;
+	if ((key = arena_alloc(a, len + 1)) == 0)
+	    return 0;
+	if (subdomain)
+	    e = names->subdomains.tab + names->subdomains.n++;
+	else
+	    e = names->exact.tab + names->exact.n++;
+	e->key = key;
+	name_fold(name, len, lower);
+	e->len = name_key(lower, len, key);
+
+	/* The parent domain key is the exact key sans its last label. */
+	if (!subdomain && memchr(name, '.', len) != 0) {
+	    dane_name *p = names->parents.tab + names->parents.n;
+
+	    p->key = key;
+	    for (p->len = e->len; key[p->len - 1] != '.'; --p->len)
+		/* NOP */;
+	    if (--p->len > 0)
+		++names->parents.n;
+	}
+    }
+    return names_sort(a, &names->exact)
+	&& names_sort(a, &names->parents)
+	&& names_sort(a, &names->subdomains);
+}
+
+/*
+ * Match the key of a certificate name.  Each test is a lookup in one of the
+ * compiled tables, by hash in large tables, so the cost barely depends on
+ * the number of reference names.
+ */
+static int match_name(const char *key, size_t len, DANESSL *dane)
+{
+    dane_names *names = &dane->names;
+    uint32_t hash = NAME_HASH_INIT;
+    uint32_t parent = 0;
+    size_t i;
+
+    /*
+     * Sub-domain match: certid is any sub-domain of a ".domain" name, its
+     * key is the domain's key followed by '.' and at least one character.
+     * The hash of each such prefix, and of the wildcard parent domain key
+     * below, is had along the way to that of the whole key.
+     */
+    for (i = 0; i < len; ++i) {
+	if (key[i] == '.') {
+	    if (i > 0 && i + 1 < len
+		&& names_find(&names->subdomains, key, i, hash, 0))
+		return 1;
+	    if (i + 2 == len)
+		parent = hash;
+	}
+	hash = NAME_HASH_STEP(hash, key[i]);
+    }
+
+    if (names_find(&names->exact, key, len, hash, 0))
+	return 1;
+
+    /*
+     * Initial "*" match.  The initial "*" in a certid matches one (if multi
+     * is false) or more hostname components under the condition that the
+     * certid contains multiple hostname components.  The certid's key is
+     * then its parent domain's key followed by ".*".
+     */
+    if (len > 2 && key[len - 2] == '.' && key[len - 1] == '*') {
+	len -= 2;
+	if (names_find(&names->parents, key, len, parent, 0)
+	    || (dane->multi
+		&& names_find(&names->parents, key, len + 1, 0, 1)))
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Validate the "len" byte name "name", storing its lower case form in the
+ * DANE_NAME_MAX + 1 byte buffer "lower".  Returns the length sans any
+ * trailing NULs, or 0 if the name is empty, too long to match any reference
+ * name, or not just LDH, '.' and '*' (internal NULs included).
+ */
+static size_t check_name(const char *name, size_t len, char *lower)
+{
+    while (len > 0 && name[len - 1] == 0)
+	--len;				/* Ignore trailing NULs */
+    if (len == 0 || len > DANE_NAME_MAX)
+	return 0;
+    return name_fold(name, len, lower) ? len : 0;
+}
+
+static const char *parse_dns_name(const GENERAL_NAME *gn, size_t *len)
+{
+    if (gn->type != GEN_DNS)
+	return 0;
+    if (ASN1_STRING_type(gn->d.ia5) != V_ASN1_IA5STRING)
+	return 0;
+    *len = ASN1_STRING_length(gn->d.ia5);
+    return (const char *) ASN1_STRING_get0_data(gn->d.ia5);
+}
+
+static char *parse_subject_name(X509 *cert, size_t *namelen)
+{
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_ENTRY *entry;
+    ASN1_STRING *entry_str;
+    unsigned char *namebuf;
+    int nid = NID_commonName;
+    int len;
+    int i;
+
+    if (name == 0 || (i = X509_NAME_get_index_by_NID(name, nid, -1)) < 0)
+	return 0;
+    if ((entry = X509_NAME_get_entry(name, i)) == 0)
+	return 0;
+    if ((entry_str = X509_NAME_ENTRY_get_data(entry)) == 0)
+	return 0;
+
+    if ((len = ASN1_STRING_to_UTF8(&namebuf, entry_str)) < 0)
+	return 0;
+    *namelen = len;
+    return (char *) namebuf;
+}
+
+/*
+ * The DNS names of a certificate, the subjectAltName dNSNames, if any, or
+ * else the subject common name, are extracted and validated once per
+ * verification, into the connection's arena.  Certificates are shared
+ * between threads, names attached to them would need a lock on every
+ * lookup.  The names are packed into a single buffer, each as its length
+ * byte, the name, and the name's matching key, both NUL-terminated.  Names
+ * too long to match any reference name are left out.
+ */
+typedef struct dane_ids {
+    int n;
+    unsigned char data[1];
+} dane_ids;
+
+/*
+ * Append a valid name, or with "ids" NULL, just bound its size.  Names
+ * are validated and case-folded just once, when appended.
+ */
+static size_t ids_add(dane_ids *ids, size_t off, const char *name, size_t len)
+{
+    char lower[DANE_NAME_MAX + 1];
+    unsigned char *p;
+
+    if (ids == 0)
+	return off + 2 * len + 3;
+    if ((len = check_name(name, len, lower)) == 0)
+	return off;
+    p = ids->data + off;
+    *p++ = len;
+    memcpy(p, name, len);
+    p[len] = '\0';
+    name_key(lower, len, (char *) p + len + 1);
+    ++ids->n;
+    return off + 2 * len + 3;
+}
+
+/*
+ * Two passes over the subjectAltName dNSNames, the first to size the
+ * buffer, the second to fill it in.
+ */
+static dane_ids *ids_build(dane_arena *a, X509 *cert)
+{
+    GENERAL_NAMES *gens;
+    dane_ids *ids = 0;
+    char *cn = 0;
+    size_t cnlen = 0;
+    size_t size = 0;
+    int got_altname = 0;
+    int pass;
+    int i;
+
+    gens = X509_get_ext_d2i(cert, NID_subject_alt_name, 0, 0);
+    for (pass = 0; pass < 2; ++pass) {
+	size_t off = 0;
+
+	for (i = 0; i < sk_GENERAL_NAME_num(gens); ++i) {
+	    const GENERAL_NAME *gn = sk_GENERAL_NAME_value(gens, i);
+	    const char *certid;
+	    size_t len;
+
+	    if (gn->type != GEN_DNS)
+		continue;
+	    got_altname = 1;
+	    if ((certid = parse_dns_name(gn, &len)) != 0)
+		off = ids_add(ids, off, certid, len);
+	}
+
+	/*
+	 * XXX: Should the subjectName be skipped when *any* altnames are
+	 * present, or only when DNS altnames are present?
+	 */
+	if (got_altname == 0) {
+	    if (pass == 0)
+		cn = parse_subject_name(cert, &cnlen);
+	    if (cn != 0)
+		off = ids_add(ids, off, cn, cnlen);
+	}
+
+	if (pass == 0) {
+	    size = off;
+	    if ((ids = arena_alloc(a, sizeof(*ids) + size)) == 0)
+		break;
+	    ids->n = 0;
+	}
+    }
+    if (gens)
+	GENERAL_NAMES_free(gens);
+    if (cn)
+	OPENSSL_free(cn);
+    return ids;
+}
+
+static int name_check(DANESSL *dane, X509 *cert)
+{
+    const unsigned char *p;
+    dane_ids *ids;
+    int matched = 0;
+    int i;
+
+    if ((ids = ids_build(&dane->arena, cert)) == 0) {
+	DANEerr(DANESSL_F_VERIFY_CERT, ERR_R_MALLOC_FAILURE);
+	return -1;
+    }
+    for (i = 0, p = ids->data; i < ids->n; ++i) {
+	size_t len = *p++;
+	const char *certid = (const char *) p;
+
+	p += 2 * len + 2;
+	if ((matched = match_name(certid + len + 1, len, dane)) == 0)
+	    continue;
+	if ((dane->mhost = arena_strdup(&dane->arena, certid)) == 0) {
+	    DANEerr(DANESSL_F_VERIFY_CERT, ERR_R_MALLOC_FAILURE);
+	    matched = -1;
+	}
+	break;
+    }
+    return matched;
+}
+
+static int verify_chain(X509_STORE_CTX *ctx)
+{
+    dane_table *issuer_rrs;
+    dane_table *leaf_rrs;
+    int (*cb)(int, X509_STORE_CTX *) = X509_STORE_CTX_get_verify_cb(ctx);
+    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, ssl_store_idx);
+    DANESSL *dane = SSL_get_ex_data(ssl, dane_idx);
+    X509 *cert = X509_STORE_CTX_get0_cert(ctx);
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+    int chain_length = sk_X509_num(chain);
+    int matched = 0;
+
+    issuer_rrs = &dane->policy->tables[DANESSL_USAGE_PKIX_TA];
+    leaf_rrs = &dane->policy->tables[DANESSL_USAGE_PKIX_EE];
+
+    /* Restore OpenSSL's internal_verify() as the signature check function */
+    X509_STORE_CTX_set_verify(ctx, dane->verify);
+
+    if ((matched = name_check(dane, cert)) < 0) {
+	X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+	return 0;
+    }
+
+    if (!matched) {
+	X509_STORE_CTX_set_error_depth(ctx, 0);
+	X509_STORE_CTX_set_current_cert(ctx, cert);
+	X509_STORE_CTX_set_error(ctx, X509_V_ERR_HOSTNAME_MISMATCH);
+	if (!cb(0, ctx))
+	    return 0;
+    }
+    matched = 0;
+
+    /*
+     * Satisfy at least one usage 0 or 1 constraint, unless we've already
+     * matched a usage 2 trust anchor.
+     *
+     * XXX: internal_verify() doesn't callback with top certs that are not
+     * self-issued.  This is fixed in OpenSSL 1.1.0.
+     */
+    if (dane->roots && sk_X509_num(dane->roots)) {
+	X509 *top = sk_X509_value(chain, dane->depth);
+
+	dane->mdpth = dane->depth;
+	dane->match = top;
+	X509_up_ref(top);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if (X509_check_issued(top, top) != X509_V_OK) {
+	    X509_STORE_CTX_set_error_depth(ctx, dane->depth);
+	    X509_STORE_CTX_set_current_cert(ctx, top);
+	    if (!cb(1, ctx))
+		return 0;
+	}
+#endif
+	/* Pop synthetic trust-anchor ancestors off the chain! */
+	while (--chain_length > dane->depth)
+	    X509_free(sk_X509_pop(chain));
+    } else {
+	int n = 0;
+	X509 *xn = cert;
+
+	/*
+	 * Check for an EE match, then a CA match at depths > 0, and
+	 * finally, if the EE cert is self-issued, for a depth 0 CA match.
+	 */
+	if (leaf_rrs->ngroups)
+	    matched = match(dane, leaf_rrs, xn, 0);
+	if (!matched && issuer_rrs->ngroups) {
+	    for (n = chain_length-1; n >= 0; --n) {
+		xn = sk_X509_value(chain, n);
+		if ((n > 0 || X509_check_issued(xn, xn) == X509_V_OK)
+		    && (matched = match(dane, issuer_rrs, xn, n)) != 0)
+		    break;
+	    }
+	}
+
+	if (matched < 0) {
+	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+	    return 0;
+	}
+
+	if (!matched) {
+	    X509_STORE_CTX_set_current_cert(ctx, cert);
+	    X509_STORE_CTX_set_error_depth(ctx, 0);
+	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_CERT_UNTRUSTED);
+	    if (!cb(0, ctx))
+		return 0;
+	} else {
+	    dane->mdpth = n;
+	    dane->match = xn;
+	    X509_up_ref(xn);
+	}
+    }
+
+    /* Tail recurse into OpenSSL's internal_verify */
+    return dane->verify(ctx);
+}
+
+/*
+ * The roots and chain stacks are emptied, not freed, for reuse by the next
+ * verification.
+ */
+static void dane_reset(DANESSL *dane)
+{
+    X509 *x;
+
+    dane->depth = -1;
+    dane->mhost = 0;
+    arena_rewind(&dane->arena, &dane->mark);
+    if (dane->roots)
+	while ((x = sk_X509_pop(dane->roots)) != 0)
+	    X509_free(x);
+    if (dane->chain)
+	while ((x = sk_X509_pop(dane->chain)) != 0)
+	    X509_free(x);
+    if (dane->match) {
+	X509_free(dane->match);
+	dane->match = 0;
+    }
+    memo_reset(dane);
+    dane->mdpth = -1;
+}
+
+/*
+ * With OpenSSL 1.1.0 and later, connections that have reference names are
+ * by default verified by OpenSSL's own DANE implementation, which needs no
+ * synthetic certificates or chain surgery.  Each connection's TLSA records
+ * are handed to OpenSSL when its chain is first verified.  Connections with
+ * records OpenSSL can't use fall back to the implementation above.
+ */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define DANE_NATIVE 1
+#else
+#define DANE_NATIVE 0
+#endif
+
+/* Read by DANESSL_init(), which may run in other threads */
+static dane_atomic dane_backend = DANESSL_BACKEND_AUTO;
+
+static int native_ok(void)
+{
+#if DANE_NATIVE
+    return OpenSSL_version_num() >= 0x10100000L;
+#else
+    return 0;
+#endif
+}
+
+int DANESSL_set_backend(int backend)
+{
+    switch (backend) {
+    case DANESSL_BACKEND_NATIVE:
+	if (!native_ok()) {
+	    DANEerr(DANESSL_F_SET_BACKEND, DANESSL_R_SUPPORT);
+	    return 0;
+	}
+	/* FALLTHROUGH */
+    case DANESSL_BACKEND_AUTO:
+    case DANESSL_BACKEND_COMPAT:
+	dane_atomic_set(&dane_backend, backend);
+	return 1;
+    }
+    DANEerr(DANESSL_F_SET_BACKEND, DANESSL_R_BAD_BACKEND);
+    return 0;
+}
+
+#if DANE_NATIVE
+static int native_init(SSL *ssl, const char *sni_domain,
+		       const char **hostnames)
+{
+    const char **h;
+
+    if (dane_atomic_get(&dane_backend) == DANESSL_BACKEND_COMPAT
+	|| !native_ok() || hostnames == 0 || *hostnames == 0)
+	return 0;
+
+    /*
+     * The SNI name, if any, is already set.  OpenSSL would otherwise set it
+     * to the first reference name.
+     */
+    ERR_set_mark();
+    if (SSL_dane_enable(ssl, *hostnames) <= 0) {
+	ERR_pop_to_mark();
+	return 0;
+    }
+    ERR_pop_to_mark();
+    if (sni_domain == 0 && !SSL_set_tlsext_host_name(ssl, 0))
+	return -1;
+    for (h = hostnames + 1; *h; ++h)
+	if (!SSL_add1_host(ssl, *h))
+	    return -1;
+
+    /*
+     * Our name checks only support wildcards as a complete first label, and
+     * don't apply to DANE-EE(3) matches.
+     */
+    SSL_set_hostflags(ssl, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+    SSL_dane_set_flags(ssl, DANE_FLAG_NO_DANE_EE_NAMECHECKS);
+    return 1;
+}
+
+static int md_mtype(const EVP_MD *md)
+{
+    int m;
+
+    for (m = 0; m <= DANESSL_MATCHING_LAST; ++m)
+	if (md == mtype_md[m])
+	    return m;
+    return -1;
+}
+
+/*
+ * Hand the connection's TLSA records to OpenSSL.  Returns 1 on success, 0
+ * when OpenSSL can't use them, and -1 on error.
+ */
+static int native_load(SSL *ssl, DANESSL *dane)
+{
+    DANESSL_POLICY *pol = dane->policy;
+    int added = 0;
+    int u;
+    int i;
+    int j;
+
+    /* Once handed over the records are fixed, but perhaps only in part. */
+    if (dane->loaded)
+	return dane->nloaded == pol->count ? 1 : -1;
+
+    /* Only the standard matching types can be expressed natively. */
+    for (u = 0; u <= DANESSL_USAGE_LAST; ++u)
+	for (i = 0; i < pol->tables[u].ngroups; ++i)
+	    if (md_mtype(pol->tables[u].groups[i].md) < 0)
+		return 0;
+
+    for (u = 0; u <= DANESSL_USAGE_LAST; ++u) {
+	for (i = 0; i < pol->tables[u].ngroups; ++i) {
+	    dane_group *g = &pol->tables[u].groups[i];
+	    int mtype = md_mtype(g->md);
+
+	    for (j = 0; j < g->nent; ++j) {
+		int ret;
+
+		ERR_set_mark();
+		ret = SSL_dane_tlsa_add(ssl, u, g->selector, mtype,
+					g->ent[j].data, g->ent[j].len);
+		if (ret < 0)
+		    return -1;
+		if (ret == 0) {
+		    ERR_pop_to_mark();	/* Unusable, skip */
+		} else {
+		    dane->loaded = pol;
+		    ++added;
+		}
+	    }
+	}
+    }
+
+    /*
+     * Without any usable records OpenSSL would just do PKIX, rather than
+     * fail, so let the compatibility code decide.
+     */
+    if (pol->count > 0 && added == 0)
+	return 0;
+    dane->nloaded = pol->count;
+    return 1;
+}
+
+/*
+ * Record OpenSSL's DANE match in "dane", as the compatibility code does,
+ * so that DANESSL_get_match_cert() and the verdict cache need not care
+ * which backend did the work.  The matched name is only in "ctx", which
+ * DANESSL_verify_chain() does not keep.  Returns -1 on error.
+ */
+static int native_match(X509_STORE_CTX *ctx, SSL *ssl, DANESSL *dane)
+{
+    const char *peer;
+    X509 *mcert = 0;
+    int mdpth = SSL_get0_dane_authority(ssl, &mcert, 0);
+
+    if (mdpth < 0 || mcert == 0)
+	return 0;
+    peer = X509_VERIFY_PARAM_get0_peername(X509_STORE_CTX_get0_param(ctx));
+    if (peer && (dane->mhost = arena_strdup(&dane->arena, peer)) == 0) {
+	DANEerr(DANESSL_F_VERIFY_CERT, ERR_R_MALLOC_FAILURE);
+	return -1;
+    }
+    X509_up_ref(mcert);
+    dane->match = mcert;
+    dane->mdpth = mdpth;
+    return 1;
+}
+
+static int native_verify(X509_STORE_CTX *ctx, SSL *ssl, DANESSL *dane)
+{
+    DANESSL_POLICY *pol = dane->policy;
+    X509 *cert = X509_STORE_CTX_get0_cert(ctx);
+    int ret = 0;
+
+    /*
+     * OpenSSL does not support the degenerate case of a self-issued leaf
+     * certificate that is its own trust anchor.
+     */
+    if ((!pol->tables[DANESSL_USAGE_DANE_TA].ngroups
+	 && !pol->tables[DANESSL_USAGE_PKIX_TA].ngroups)
+	|| X509_check_issued(cert, cert) != X509_V_OK)
+	ret = native_load(ssl, dane);
+
+    switch (ret) {
+    case 1:
+	X509_STORE_CTX_set0_dane(ctx, SSL_get0_dane(ssl));
+	if ((ret = X509_verify_cert(ctx)) <= 0
+	    || native_match(ctx, ssl, dane) >= 0)
+	    return ret;
+	break;
+    case 0:
+	/* Fall back, and leave the name checks to verify_chain() */
+	dane->native = 0;
+	X509_VERIFY_PARAM_set1_host(X509_STORE_CTX_get0_param(ctx), 0, 0);
+	return -2;
+    }
+    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+    return -1;
+}
+#else
+#define native_init(ssl, sni_domain, hostnames) 0
+#define native_verify(ctx, ssl, dane) -2
+#endif
+
+/*
+ * Cache of whole verification verdicts.  A successful verification is
+ * recorded under a SHA-256 digest of everything that determines its
+ * outcome: the peer's chain, the TLSA records, the reference names, the
+ * backend, the trust store and verification parameters, the connection's
+ * role and security level, and the current time bucket.  Entries thus
+ * lapse at the end of their bucket, and none is made when a certificate of
+ * the chain expires sooner.  The table is direct-mapped, with its slots
+ * divided among a number of locks.
+ */
+typedef struct dane_verdict {
+    unsigned char  id[SHA256_DIGEST_LENGTH];
+    STACK_OF(X509) *chain;		/* Verified chain, NULL when empty */
+    X509	   *match;
+    char	   *mhost;
+    int		   mdpth;
+} dane_verdict;
+
+#define DANE_VERDICT_LOCKS	16	/* Power of 2 */
+
+struct DANESSL_VERDICTS {
+    unsigned long  ttl;
+    size_t	   nslots;		/* Power of 2 */
+    dane_verdict   *slots;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    CRYPTO_RWLOCK  *locks[DANE_VERDICT_LOCKS];
+#endif
+};
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define verdict_rlock(v, i) CRYPTO_r_lock(CRYPTO_LOCK_SSL_SESSION)
+#define verdict_wlock(v, i) CRYPTO_w_lock(CRYPTO_LOCK_SSL_SESSION)
+#define verdict_runlock(v, i) CRYPTO_r_unlock(CRYPTO_LOCK_SSL_SESSION)
+#define verdict_wunlock(v, i) CRYPTO_w_unlock(CRYPTO_LOCK_SSL_SESSION)
+#else
+#define verdict_lock(v, i) ((v)->locks[(i) & (DANE_VERDICT_LOCKS - 1)])
+#define verdict_rlock(v, i) CRYPTO_THREAD_read_lock(verdict_lock(v, i))
+#define verdict_wlock(v, i) CRYPTO_THREAD_write_lock(verdict_lock(v, i))
+#define verdict_runlock(v, i) CRYPTO_THREAD_unlock(verdict_lock(v, i))
+#define verdict_wunlock(v, i) CRYPTO_THREAD_unlock(verdict_lock(v, i))
+#endif
+
+static void verdict_clear(dane_verdict *e)
+{
+    if (e->chain)
+	sk_X509_pop_free(e->chain, X509_free);
+    if (e->match)
+	X509_free(e->match);
+    if (e->mhost)
+	OPENSSL_free(e->mhost);
+    memset(e, 0, sizeof(*e));
+}
+
+DANESSL_VERDICTS *DANESSL_VERDICTS_new(size_t size, unsigned long ttl)
+{
+    DANESSL_VERDICTS *v;
+    size_t n = 1;
+    int i;
+
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_VERDICTS_NEW, DANESSL_R_LIBRARY_INIT);
+	return 0;
+    }
+    while (n < size && n <= SIZE_MAX / (2 * sizeof(*v->slots)))
+	n *= 2;
+    if (ttl == 0 || (v = OPENSSL_malloc(sizeof(*v))) == 0) {
+	DANEerr(DANESSL_F_VERDICTS_NEW, ERR_R_MALLOC_FAILURE);
+	return 0;
+    }
+    memset(v, 0, sizeof(*v));
+    v->ttl = ttl;
+    v->nslots = n;
+    if ((v->slots = OPENSSL_malloc(n * sizeof(*v->slots))) == 0) {
+	DANEerr(DANESSL_F_VERDICTS_NEW, ERR_R_MALLOC_FAILURE);
+	DANESSL_VERDICTS_free(v);
+	return 0;
+    }
+    memset(v->slots, 0, n * sizeof(*v->slots));
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    for (i = 0; i < DANE_VERDICT_LOCKS; ++i) {
+	if ((v->locks[i] = CRYPTO_THREAD_lock_new()) == 0) {
+	    DANEerr(DANESSL_F_VERDICTS_NEW, ERR_R_MALLOC_FAILURE);
+	    DANESSL_VERDICTS_free(v);
+	    return 0;
+	}
+    }
+#else
+    (void) i;
+#endif
+    return v;
+}
+
+void DANESSL_VERDICTS_free(DANESSL_VERDICTS *v)
+{
+    size_t i;
+
+    if (v == 0)
+	return;
+    if (v->slots) {
+	for (i = 0; i < v->nslots; ++i)
+	    verdict_clear(&v->slots[i]);
+	OPENSSL_free(v->slots);
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    for (i = 0; i < DANE_VERDICT_LOCKS; ++i)
+	if (v->locks[i])
+	    CRYPTO_THREAD_lock_free(v->locks[i]);
+#endif
+    OPENSSL_free(v);
+}
+
+int DANESSL_set_verdicts(SSL *ssl, DANESSL_VERDICTS *v)
+{
+    DANESSL *dane;
+
+    if (!dane_ready_get() || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0) {
+	DANEerr(DANESSL_F_SET_VERDICTS, DANESSL_R_INIT);
+	return -1;
+    }
+    dane->verdicts = v;
+    return 1;
+}
+
+static int digest_long(EVP_MD_CTX *mdctx, long val)
+{
+    unsigned char buf[8];
+    int i;
+
+    for (i = 0; i < sizeof(buf); ++i, val >>= 8)
+	buf[i] = val & 0xff;
+    return EVP_DigestUpdate(mdctx, buf, sizeof(buf));
+}
+
+static int digest_cert(DANESSL *dane, EVP_MD_CTX *mdctx, X509 *cert)
+{
+    const unsigned char *data;
+    unsigned int len;
+
+    return memo_get(dane, cert, DANESSL_SELECTOR_CERT,
+		    mtype_md[DANESSL_MATCHING_2256], &data, &len)
+	&& EVP_DigestUpdate(mdctx, data, len);
+}
+
+static int digest_names(EVP_MD_CTX *mdctx, const dane_nametab *t)
+{
+    const dane_name *tab = t->tab;
+    int ok = digest_long(mdctx, t->n);
+    int i;
+
+    for (i = 0; ok && i < t->n; ++i)
+	ok = digest_long(mdctx, (long) tab[i].len)
+	    && EVP_DigestUpdate(mdctx, tab[i].key, tab[i].len);
+    return ok;
+}
+
+/*
+ * Compute the cache key of the verification of "ctx" for "ssl" in time
+ * bucket "bucket".  Variable length fields are preceded by their length.
+ * The purpose and trust settings can't be read back from "ctx", but by
+ * default follow the role of "ssl", client or server.
+ */
+static int verdict_id(DANESSL *dane, X509_STORE_CTX *ctx, SSL *ssl,
+		      time_t bucket, unsigned char *id)
+{
+    DANESSL_POLICY *pol = dane->policy;
+    X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(ctx);
+    STACK_OF(X509) *in = X509_STORE_CTX_get0_untrusted(ctx);
+    const void *store = X509_STORE_CTX_get0_store(ctx);
+    const EVP_MD *md = mtype_md[DANESSL_MATCHING_2256];
+    const unsigned char *data;
+    unsigned int len;
+    EVP_MD_CTX *mdctx;
+    int n = sk_X509_num(in);
+    int ok;
+    int u;
+    int i;
+    int j;
+
+    /*
+     * Memoize the certificate digests first, computing them uses the same
+     * digest contexts.
+     */
+    for (i = -1; i < n; ++i)
+	if (!memo_get(dane, i < 0 ? X509_STORE_CTX_get0_cert(ctx) :
+		      sk_X509_value(in, i), DANESSL_SELECTOR_CERT, md,
+		      &data, &len))
+	    return 0;
+    if ((mdctx = md_ctx(dane, md)) == 0)
+	return 0;
+
+    ok = EVP_DigestInit_ex(mdctx, md, 0)
+	&& EVP_DigestUpdate(mdctx, &store, sizeof(store))
+	&& digest_long(mdctx, (long) bucket)
+	&& digest_long(mdctx, X509_VERIFY_PARAM_get_flags(param))
+	&& digest_long(mdctx, X509_VERIFY_PARAM_get_depth(param))
+	&& digest_long(mdctx, X509_VERIFY_PARAM_get_auth_level(param))
+	&& digest_long(mdctx, SSL_get_security_level(ssl))
+	&& digest_long(mdctx, SSL_is_server(ssl))
+	&& digest_long(mdctx, dane->native)
+	&& digest_long(mdctx, dane->multi)
+	&& digest_long(mdctx, n < 0 ? 0 : n)
+	&& digest_cert(dane, mdctx, X509_STORE_CTX_get0_cert(ctx));
+    for (i = 0; ok && i < n; ++i)
+	ok = digest_cert(dane, mdctx, sk_X509_value(in, i));
+
+    for (u = 0; ok && u <= DANESSL_USAGE_LAST; ++u) {
+	dane_table *t = &pol->tables[u];
+
+	ok = digest_long(mdctx, t->ngroups);
+	for (i = 0; ok && i < t->ngroups; ++i) {
+	    dane_group *g = t->groups + i;
+
+	    ok = digest_long(mdctx, g->selector)
+		&& digest_long(mdctx, g->md ? EVP_MD_type(g->md) : NID_undef)
+		&& digest_long(mdctx, g->nent);
+	    for (j = 0; ok && j < g->nent; ++j)
+		ok = digest_long(mdctx, (long) g->ent[j].len)
+		    && EVP_DigestUpdate(mdctx, g->ent[j].data, g->ent[j].len);
+	}
+    }
+    ok = ok && digest_names(mdctx, &dane->names.exact)
+	&& digest_names(mdctx, &dane->names.subdomains);
+    return ok && EVP_DigestFinal_ex(mdctx, id, 0);
+}
+
+static dane_verdict *verdict_slot(DANESSL_VERDICTS *v,
+				  const unsigned char *id, size_t *i)
+{
+    *i = (id[0] | id[1] << 8 | id[2] << 16) & (v->nslots - 1);
+    return &v->slots[*i];
+}
+
+static STACK_OF(X509) *chain_dup(STACK_OF(X509) *chain)
+{
+    STACK_OF(X509) *copy;
+    int i;
+
+    if ((copy = sk_X509_dup(chain)) == 0)
+	return 0;
+    for (i = 0; i < sk_X509_num(copy); ++i)
+	X509_up_ref(sk_X509_value(copy, i));
+    return copy;
+}
+
+/*
+ * Restore a cached verdict into "dane" and "ctx".  Returns 1 on a hit, 0
+ * on a miss, and -1 on error.
+ */
+static int verdict_get(DANESSL *dane, X509_STORE_CTX *ctx,
+		       const unsigned char *id)
+{
+    DANESSL_VERDICTS *v = dane->verdicts;
+    STACK_OF(X509) *chain = 0;
+    dane_verdict *e;
+    size_t i;
+    int ret = 0;
+
+    e = verdict_slot(v, id, &i);
+    verdict_rlock(v, i);
+    if (memcmp(e->id, id, SHA256_DIGEST_LENGTH) == 0 && e->chain) {
+	ret = -1;
+	if ((chain = chain_dup(e->chain)) != 0
+	    && (e->mhost == 0
+		|| (dane->mhost = arena_strdup(&dane->arena, e->mhost)) != 0)) {
+	    if ((dane->match = e->match) != 0)
+		X509_up_ref(dane->match);
+	    dane->mdpth = e->mdpth;
+	    ret = 1;
+	}
+    }
+    verdict_runlock(v, i);
+
+    if (ret > 0)
+	X509_STORE_CTX_set0_verified_chain(ctx, chain);
+    else if (chain) {
+	sk_X509_pop_free(chain, X509_free);
+    }
+    return ret;
+}
+
+/*
+ * Record the successful verification of "ctx", unless the chain expires
+ * within the time bucket.
+ */
+static void verdict_put(DANESSL *dane, X509_STORE_CTX *ctx,
+			const unsigned char *id, time_t expires)
+{
+    DANESSL_VERDICTS *v = dane->verdicts;
+    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
+    X509 *match = dane->match;
+    const char *mhost = dane->mhost;
+    dane_verdict add;
+    dane_verdict old;
+    dane_verdict *e;
+    size_t i;
+    int n;
+
+    memset(&add, 0, sizeof(add));
+    add.mdpth = dane->mdpth;
+
+    for (n = 0; n < sk_X509_num(chain); ++n)
+	if (X509_cmp_time(X509_getm_notAfter(sk_X509_value(chain, n)),
+			  &expires) <= 0)
+	    return;
+    if (n == 0 || (add.chain = chain_dup(chain)) == 0
+	|| (mhost && (add.mhost = OPENSSL_strdup(mhost)) == 0)) {
+	verdict_clear(&add);
+	return;
+    }
+    if ((add.match = match) != 0)
+	X509_up_ref(match);
+    memcpy(add.id, id, SHA256_DIGEST_LENGTH);
+
+    e = verdict_slot(v, id, &i);
+    verdict_wlock(v, i);
+    old = *e;
+    *e = add;
+    verdict_wunlock(v, i);
+    verdict_clear(&old);
+}
+
+static
+int verify_cert(X509_STORE_CTX *ctx, void *unused_ctx)
+{
+    SSL *ssl;
+    DANESSL *dane;
+    int (*cb)(int, X509_STORE_CTX *) = X509_STORE_CTX_get_verify_cb(ctx);
+    X509 *cert = X509_STORE_CTX_get0_cert(ctx);
+    unsigned char id[SHA256_DIGEST_LENGTH];
+    time_t expires = 0;
+    int matched;
+    int ret;
+
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_VERIFY_CERT, ERR_R_MALLOC_FAILURE);
+	return -1;
+    }
+
+    ssl = X509_STORE_CTX_get_ex_data(ctx, ssl_store_idx);
+    if ((dane = SSL_get_ex_data(ssl, dane_idx)) == 0 || cert == 0)
+	return X509_verify_cert(ctx);
+
+    /*
+     * Reset for verification of a new chain, perhaps a renegotiation.  The
+     * records verified with can no longer change, OpenSSL's copy can't.
+     */
+    dane_reset(dane);
+    dane->fixed = 1;
+
+    /*
+     * With a verdict cache, and the current time, look for the result of
+     * an identical earlier verification.
+     */
+    if (dane->verdicts
+	&& !(X509_VERIFY_PARAM_get_flags(X509_STORE_CTX_get0_param(ctx))
+	     & X509_V_FLAG_USE_CHECK_TIME)) {
+	time_t bucket = time(0) / dane->verdicts->ttl;
+
+	if (verdict_id(dane, ctx, ssl, bucket, id))
+	    expires = (bucket + 1) * dane->verdicts->ttl;
+	if (expires && (ret = verdict_get(dane, ctx, id)) != 0) {
+	    memo_reset(dane);
+	    if (ret < 0) {
+		DANEerr(DANESSL_F_VERIFY_CERT, ERR_R_MALLOC_FAILURE);
+		X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+		return -1;
+	    }
+	    X509_STORE_CTX_set_error_depth(ctx, 0);
+	    X509_STORE_CTX_set_current_cert(ctx, cert);
+	    return cb(1, ctx);
+	}
+    }
+
+    if (dane->native && (ret = native_verify(ctx, ssl, dane)) != -2) {
+	if (ret > 0 && expires
+	    && X509_STORE_CTX_get_error(ctx) == X509_V_OK)
+	    verdict_put(dane, ctx, id, expires);
+	memo_reset(dane);
+	return ret;
+    }
+
+    if (dane->policy->tables[DANESSL_USAGE_DANE_EE].ngroups) {
+	if ((matched = check_end_entity(ctx, dane, cert)) > 0) {
+	    X509_STORE_CTX_set_error_depth(ctx, 0);
+	    X509_STORE_CTX_set_current_cert(ctx, cert);
+	    return cb(1, ctx);
+	}
+	if (matched < 0) {
+	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+	    return -1;
+	}
+	/* Fail now, if all we have is DANE-EE TLSA records */
+	if (!matched
+	    && !dane->policy->tables[DANESSL_USAGE_DANE_TA].ngroups
+	    && !dane->policy->tables[DANESSL_USAGE_PKIX_EE].ngroups
+	    && !dane->policy->tables[DANESSL_USAGE_PKIX_TA].ngroups) {
+	    X509_STORE_CTX_set_current_cert(ctx, cert);
+	    X509_STORE_CTX_set_error_depth(ctx, 0);
+	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_CERT_UNTRUSTED);
+	    return cb(0, ctx);
+	}
+    }
+
+    if ((dane->policy->tables[DANESSL_USAGE_DANE_TA].ngroups
+	 || dane->policy->tables[DANESSL_USAGE_PKIX_TA].ngroups)
+	&& !hash_chain(dane, cert, X509_STORE_CTX_get0_untrusted(ctx))) {
+	X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+	return -1;
+    }
+
+    if (dane->policy->tables[DANESSL_USAGE_DANE_TA].ngroups) {
+	if ((matched = set_trust_anchor(ctx, dane, cert)) < 0) {
+	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+	    return -1;
+	}
+	if (matched) {
+	    /*
+	     * Check that setting the untrusted chain updates the expected
+	     * structure member at the expected offset.
+	     */
+	    X509_STORE_CTX_set0_trusted_stack(ctx, dane->roots);
+	    X509_STORE_CTX_set0_untrusted(ctx, dane->chain);
+	    OPENSSL_assert(dane->chain == X509_STORE_CTX_get0_untrusted(ctx));
+	}
+    }
+
+    /*
+     * Name checks and usage 0/1 constraint enforcement are delayed until
+     * X509_verify_cert() builds the full chain and calls our verify_chain()
+     * wrapper.
+     */
+    dane->verify = X509_STORE_CTX_get_verify(ctx);
+    X509_STORE_CTX_set_verify(ctx, verify_chain);
+
+    ret = X509_verify_cert(ctx);
+    if (ret > 0 && expires && X509_STORE_CTX_get_error(ctx) == X509_V_OK)
+	verdict_put(dane, ctx, id, expires);
+
+    /* The memo is keyed by certificate pointer, don't let it go stale */
+    memo_reset(dane);
+    if (ret)
+	return 1;
+
+    /*
+     * If the chain is invalid, clear any matching cert or hostname, to
+     * protect callers that might erroneously rely on these alone without
+     * checking the validation status.
+     */
+    if (dane->match) {
+	X509_free(dane->match);
+	dane->match = 0;
+    }
+    dane->mhost = 0;
+    return 0;
+}
+
+/*
+ * Grow an arena-backed array to hold at least "want" elements of "size"
+ * bytes, copying any existing elements.  The old copy is simply abandoned
+ * to the arena.
+ */
+static int arena_grow(dane_arena *a, void **vec, size_t size, size_t have,
+		      size_t *max, size_t want)
+{
+    size_t n = *max ? *max : 4;
+    void *tmp;
+
+    if (want <= *max)
+	return 1;
+    while (n < want)
+	n *= 2;
+    if ((tmp = arena_alloc(a, n * size)) == 0)
+	return 0;
+    if (have)
+	memcpy(tmp, *vec, have * size);
+    *vec = tmp;
+    *max = n;
+    return 1;
+}
+
+/*
+ * Locate the group for the given (selector, digest) pair, creating it when
+ * "create" is set.  Groups with the same selector are kept adjacent.
+ */
+static dane_group *table_group(dane_arena *a, dane_table *t,
+			       uint8_t selector, const EVP_MD *md, int create)
+{
+    dane_group *g;
+    int i;
+
+    for (i = 0; i < t->ngroups; ++i) {
+	g = t->groups + i;
+	if (g->selector == selector && g->md == md)
+	    return g;
+	if (g->selector > selector)
+	    break;
+    }
+    if (!create)
+	return 0;
+
+    if (!arena_grow(a, (void **) &t->groups, sizeof(*g), t->ngroups,
+		    &t->mgroups, t->ngroups + 1))
+	return 0;
+    g = t->groups + i;
+    memmove(g + 1, g, (t->ngroups - i) * sizeof(*g));
+    ++t->ngroups;
+
+    memset(g, 0, sizeof(*g));
+    g->selector = selector;
+    if ((g->md = md) != 0)
+	g->mdlen = EVP_MD_size(md);
+    return g;
+}
+
+/*
+ * Make room for "n" more entries.
+ */
+static int group_reserve(dane_arena *a, dane_group *g, size_t n)
+{
+    return arena_grow(a, (void **) &g->ent, sizeof(*g->ent), g->nent,
+		      &g->ment, g->nent + n);
+}
+
+/*
+ * Return a stable copy of the association data, or with "nocopy" the data
+ * itself.
+ */
+static const unsigned char *arena_data(dane_arena *a,
+				       const unsigned char *data, size_t len,
+				       int nocopy)
+{
+    unsigned char *copy;
+
+    if (nocopy)
+	return data;
+    if ((copy = arena_alloc(a, len)) != 0)
+	memcpy(copy, data, len);
+    return copy;
+}
+
+static int group_insert(dane_arena *a, dane_group *g, int pos,
+			const unsigned char *data, size_t len)
+{
+    dane_entry *e;
+
+    if (!group_reserve(a, g, 1) || (data = arena_data(a, data, len, 0)) == 0)
+	return 0;
+
+    e = g->ent + pos;
+    memmove(e + 1, e, (g->nent - pos) * sizeof(*e));
+    ++g->nent;
+    e->data = data;
+    e->len = len;
+    return 1;
+}
+
+static void table_remove(dane_table *t, dane_group *g)
+{
+    --t->ngroups;
+    memmove(g, g + 1, (t->ngroups - (g - t->groups)) * sizeof(*g));
+}
+
+static void dane_free(DANESSL *dane)
+{
+    int u;
+
+    if (dane->roots)
+	sk_X509_pop_free(dane->roots, X509_free);
+    if (dane->chain)
+	sk_X509_pop_free(dane->chain, X509_free);
+    if (dane->memo)
+	OPENSSL_free(dane->memo);
+    if (dane->der)
+	OPENSSL_free(dane->der);
+    if (dane->issuers)
+	OPENSSL_free(dane->issuers);
+    for (u = 0; u < DANE_MAX_MDS; ++u)
+	if (dane->mdctx[u])
+	    EVP_MD_CTX_free(dane->mdctx[u]);
+    arena_free(&dane->arena);
+    OPENSSL_free(dane);
+}
+
+/*
+ * Released handles are kept on a per-thread free-list, together with their
+ * arena, stacks, digest memo and digest contexts, so that a new connection
+ * in the same thread can reuse them without further allocation.  Without
+ * thread-local storage (OpenSSL 1.0.x), handles are not recycled.
+ */
+#define DANE_POOL_MAX	16
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+typedef struct dane_pool {
+    DANESSL *free;
+    int	    count;
+} dane_pool;
+
+static CRYPTO_THREAD_LOCAL pool_key;
+static int pool_ok;
+
+static void pool_free(void *arg)
+{
+    dane_pool *pool = arg;
+    DANESSL *dane;
+
+    if (pool == 0)
+	return;
+    while ((dane = pool->free) != 0) {
+	pool->free = dane->next;
+	dane_free(dane);
+    }
+    OPENSSL_free(pool);
+}
+
+static DANESSL *pool_get(void)
+{
+    dane_pool *pool;
+    DANESSL *dane;
+
+    if (!pool_ok || (pool = CRYPTO_THREAD_get_local(&pool_key)) == 0
+	|| (dane = pool->free) == 0)
+	return 0;
+    pool->free = dane->next;
+    --pool->count;
+    return dane;
+}
+
+static int pool_put(DANESSL *dane)
+{
+    dane_pool *pool;
+
+    if (!pool_ok)
+	return 0;
+    if ((pool = CRYPTO_THREAD_get_local(&pool_key)) == 0) {
+	if ((pool = OPENSSL_malloc(sizeof(*pool))) == 0)
+	    return 0;
+	pool->free = 0;
+	pool->count = 0;
+	if (!CRYPTO_THREAD_set_local(&pool_key, pool)) {
+	    OPENSSL_free(pool);
+	    return 0;
+	}
+    }
+    if (pool->count >= DANE_POOL_MAX)
+	return 0;
+    dane->next = pool->free;
+    pool->free = dane;
+    ++pool->count;
+    return 1;
+}
+
+void DANESSL_thread_stop(void)
+{
+    if (pool_ok) {
+	pool_free(CRYPTO_THREAD_get_local(&pool_key));
+	(void) CRYPTO_THREAD_set_local(&pool_key, 0);
+    }
+}
+#else
+#define pool_get() ((DANESSL *) 0)
+#define pool_put(dane) 0
+
+void DANESSL_thread_stop(void)
+{
+}
+#endif
+
+void DANESSL_cleanup(SSL *ssl)
+{
+    DANESSL *dane;
+
+    if (!dane_ready_get() || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0)
+	return;
+    (void) SSL_set_ex_data(ssl, dane_idx, 0);
+
+    dane_reset(dane);
+    DANESSL_POLICY_free(dane->policy);
+    dane->policy = &no_policy;
+    memset(&dane->names, 0, sizeof(dane->names));
+    arena_clear(&dane->arena);
+    if (!pool_put(dane))
+	dane_free(dane);
+}
+
+
+int DANESSL_get_match_cert(SSL *ssl, X509 **match, const char **mhost, int *depth)
+{
+    DANESSL *dane;
+
+    if (!dane_ready_get() || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0) {
+	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_INIT);
+	return -1;
+    }
+
+    if (dane->match) {
+	if (match)
+	    *match = dane->match;
+	if (mhost)
+	    *mhost = dane->mhost;
+	if (depth)
+	    *depth = dane->mdpth;
+    }
+
+    return (dane->match != 0);
+}
+
+int DANESSL_verify_chain(SSL *ssl, STACK_OF(X509) *chain)
+{
+    int ret;
+    X509 *cert;
+    X509_STORE_CTX *store_ctx;
+    SSL_CTX *ssl_ctx = SSL_get_SSL_CTX(ssl);
+    X509_STORE *store = SSL_CTX_get_cert_store(ssl_ctx);
+
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_DANESSL_VERIFY_CHAIN, DANESSL_R_LIBRARY_INIT);
+	return 0;
+    }
+    cert = sk_X509_value(chain, 0);
+    if ((store_ctx = X509_STORE_CTX_new()) == NULL) {
+	DANEerr(DANESSL_F_DANESSL_VERIFY_CHAIN, ERR_R_MALLOC_FAILURE);
+	return 0;
+    }
+    if (!X509_STORE_CTX_init(store_ctx, store, cert, chain)) {
+	X509_STORE_CTX_free(store_ctx);
+	return 0;
+    }
+    X509_STORE_CTX_set_ex_data(store_ctx, ssl_store_idx, ssl);
+
+    X509_STORE_CTX_set_default(store_ctx,
+	    SSL_is_server(ssl) ? "ssl_client" : "ssl_server");
+    X509_VERIFY_PARAM_set1(X509_STORE_CTX_get0_param(store_ctx),
+	    SSL_get0_param(ssl));
+
+    if (SSL_get_verify_callback(ssl))
+	X509_STORE_CTX_set_verify_cb(store_ctx, SSL_get_verify_callback(ssl));
+
+    ret = verify_cert(store_ctx, NULL);
+
+    SSL_set_verify_result(ssl, X509_STORE_CTX_get_error(store_ctx));
+    X509_STORE_CTX_free(store_ctx);
+
+    return (ret);
+}
+
+#ifdef DANE_ASYNC
+/*
+ * Asynchronous verification.  Jobs are queued to a fixed pool of worker
+ * threads, each of which runs DANESSL_verify_chain() with its own reference
+ * to the chain.  A completed job is handed to its callback, in the worker
+ * thread, or else appended to a queue of completed jobs.  While that queue
+ * is not empty, an eventfd (a non-blocking self-pipe, other than on Linux)
+ * is readable, for the caller's event loop to poll.
+ */
+typedef struct dane_job {
+    struct dane_job *next;
+    SSL		    *ssl;
+    STACK_OF(X509)  *chain;
+    void	    (*cb)(SSL *, int, void *);
+    void	    *arg;
+    int		    ret;
+} dane_job;
+
+struct DANESSL_WORKERS {
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;		/* Signalled when jobs are queued */
+    dane_job	    *todo;		/* Pending jobs, oldest first */
+    dane_job	    **todo_tail;
+    dane_job	    *done;		/* Completed jobs, oldest first */
+    dane_job	    **done_tail;
+    pthread_t	    *threads;
+    int		    nthreads;
+    int		    stop;
+    int		    rfd;		/* Readable while "done" is not empty */
+    int		    wfd;		/* Same as "rfd" for an eventfd */
+};
+
+/*
+ * Called with the lock held, when the first job is appended to the
+ * completed queue.  The descriptor is drained once the last is collected,
+ * so it holds at most one pending event, and writes never block.
+ */
+static void async_signal(DANESSL_WORKERS *w)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    unsigned char one = 1;
+#endif
+
+    if (write(w->wfd, &one, sizeof(one)) < 0) {
+	/* Already readable */
+    }
+}
+
+static void async_drain(DANESSL_WORKERS *w)
+{
+    unsigned char buf[8];
+
+    while (read(w->rfd, buf, sizeof(buf)) > 0)
+	/* NOP */;
+}
+
+static void async_job_free(dane_job *job)
+{
+    if (job->chain)
+	sk_X509_pop_free(job->chain, X509_free);
+    OPENSSL_free(job);
+}
+
+/* Release per-thread library state before a worker thread exits */
+static void async_thread_exit(void)
+{
+    DANESSL_thread_stop();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    OPENSSL_thread_stop();
+#else
+    ERR_remove_thread_state(0);
+#endif
+}
+
+/* Default to one thread per CPU */
+static int async_nthreads(int nthreads)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    if (nthreads <= 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return (nthreads > 0 ? nthreads : 1);
+}
+
+static void *async_worker(void *arg)
+{
+    DANESSL_WORKERS *w = arg;
+    dane_job *job;
+
+    for (;;) {
+	pthread_mutex_lock(&w->lock);
+	while (w->todo == 0 && !w->stop)
+	    pthread_cond_wait(&w->ready, &w->lock);
+	/* Pending jobs are completed even when stopping */
+	if ((job = w->todo) == 0) {
+	    pthread_mutex_unlock(&w->lock);
+	    break;
+	}
+	if ((w->todo = job->next) == 0)
+	    w->todo_tail = &w->todo;
+	pthread_mutex_unlock(&w->lock);
+
+	job->ret = DANESSL_verify_chain(job->ssl, job->chain);
+	sk_X509_pop_free(job->chain, X509_free);
+	job->chain = 0;
+	job->next = 0;
+	ERR_clear_error();
+
+	if (job->cb) {
+	    job->cb(job->ssl, job->ret, job->arg);
+	    OPENSSL_free(job);
+	    continue;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (w->done == 0)
+	    async_signal(w);
+	*w->done_tail = job;
+	w->done_tail = &job->next;
+	pthread_mutex_unlock(&w->lock);
+    }
+
+    async_thread_exit();
+    return 0;
+}
+
+static int async_pipe(DANESSL_WORKERS *w)
+{
+#ifdef __linux__
+    if ((w->rfd = w->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	return 0;
+#else
+    int fds[2];
+    int i;
+
+    if (pipe(fds) < 0)
+	return 0;
+    for (i = 0; i < 2; ++i) {
+	if (fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK) < 0
+	    || fcntl(fds[i], F_SETFD, FD_CLOEXEC) < 0) {
+	    close(fds[0]);
+	    close(fds[1]);
+	    return 0;
+	}
+    }
+    w->rfd = fds[0];
+    w->wfd = fds[1];
+#endif
+    return 1;
+}
+
+/*
+ * Stop the threads once the pending jobs are done, and free everything,
+ * including any completed jobs not yet collected.
+ */
+void DANESSL_WORKERS_free(DANESSL_WORKERS *w)
+{
+    dane_job *job;
+    int i;
+
+    if (w == 0)
+	return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+    for (i = 0; i < w->nthreads; ++i)
+	pthread_join(w->threads[i], 0);
+
+    while ((job = w->done) != 0) {
+	w->done = job->next;
+	async_job_free(job);
+    }
+    close(w->rfd);
+    if (w->wfd != w->rfd)
+	close(w->wfd);
+    pthread_cond_destroy(&w->ready);
+    pthread_mutex_destroy(&w->lock);
+    OPENSSL_free(w->threads);
+    OPENSSL_free(w);
+}
+
+DANESSL_WORKERS *DANESSL_WORKERS_new(int nthreads)
+{
+    DANESSL_WORKERS *w;
+
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_WORKERS_NEW, DANESSL_R_LIBRARY_INIT);
+	return 0;
+    }
+    nthreads = async_nthreads(nthreads);
+
+    if ((w = OPENSSL_malloc(sizeof(*w))) == 0) {
+	DANEerr(DANESSL_F_WORKERS_NEW, ERR_R_MALLOC_FAILURE);
+	return 0;
+    }
+    memset(w, 0, sizeof(*w));
+    w->todo_tail = &w->todo;
+    w->done_tail = &w->done;
+    if ((w->threads = OPENSSL_malloc(nthreads * sizeof(pthread_t))) == 0) {
+	OPENSSL_free(w);
+	DANEerr(DANESSL_F_WORKERS_NEW, ERR_R_MALLOC_FAILURE);
+	return 0;
+    }
+    if (!async_pipe(w)) {
+	OPENSSL_free(w->threads);
+	OPENSSL_free(w);
+	DANEerr(DANESSL_F_WORKERS_NEW, ERR_R_SYS_LIB);
+	return 0;
+    }
+    pthread_mutex_init(&w->lock, 0);
+    pthread_cond_init(&w->ready, 0);
+
+    for (/* NOP */; w->nthreads < nthreads; ++w->nthreads) {
+	if (pthread_create(&w->threads[w->nthreads], 0, async_worker, w) != 0) {
+	    DANESSL_WORKERS_free(w);
+	    DANEerr(DANESSL_F_WORKERS_NEW, ERR_R_SYS_LIB);
+	    return 0;
+	}
+    }
+    return w;
+}
+
+int DANESSL_WORKERS_fd(DANESSL_WORKERS *w)
+{
+    return w->rfd;
+}
+
+int DANESSL_verify_chain_async(DANESSL_WORKERS *w, SSL *ssl,
+			       STACK_OF(X509) *chain,
+			       void (*cb)(SSL *, int, void *), void *arg)
+{
+    dane_job *job;
+    int i;
+
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_VERIFY_CHAIN_ASYNC, DANESSL_R_LIBRARY_INIT);
+	return 0;
+    }
+    if ((job = OPENSSL_malloc(sizeof(*job))) == 0
+	|| (job->chain = sk_X509_dup(chain)) == 0) {
+	if (job)
+	    OPENSSL_free(job);
+	DANEerr(DANESSL_F_VERIFY_CHAIN_ASYNC, ERR_R_MALLOC_FAILURE);
+	return 0;
+    }
+    /*
+     * Cache the extensions now, lest workers sharing the certificates race
+     * to do so.
+     */
+    for (i = 0; i < sk_X509_num(job->chain); ++i) {
+	X509 *cert = sk_X509_value(job->chain, i);
+
+	X509_up_ref(cert);
+	(void) X509_check_purpose(cert, -1, 0);
+    }
+    job->next = 0;
+    job->ssl = ssl;
+    job->cb = cb;
+    job->arg = arg;
+    job->ret = -1;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->stop) {
+	pthread_mutex_unlock(&w->lock);
+	async_job_free(job);
+	DANEerr(DANESSL_F_VERIFY_CHAIN_ASYNC, DANESSL_R_SUPPORT);
+	return 0;
+    }
+    *w->todo_tail = job;
+    w->todo_tail = &job->next;
+    pthread_cond_signal(&w->ready);
+    pthread_mutex_unlock(&w->lock);
+    return 1;
+}
+
+SSL *DANESSL_WORKERS_done(DANESSL_WORKERS *w, int *ret)
+{
+    dane_job *job;
+    SSL *ssl;
+
+    pthread_mutex_lock(&w->lock);
+    if ((job = w->done) != 0) {
+	if ((w->done = job->next) == 0) {
+	    w->done_tail = &w->done;
+	    async_drain(w);
+	}
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if (job == 0)
+	return 0;
+    ssl = job->ssl;
+    if (ret)
+	*ret = job->ret;
+    OPENSSL_free(job);
+    return ssl;
+}
+#else
+DANESSL_WORKERS *DANESSL_WORKERS_new(int nthreads)
+{
+    DANEerr(DANESSL_F_WORKERS_NEW, DANESSL_R_SUPPORT);
+    return 0;
+}
+
+void DANESSL_WORKERS_free(DANESSL_WORKERS *w)
+{
+}
+
+int DANESSL_WORKERS_fd(DANESSL_WORKERS *w)
+{
+    return -1;
+}
+
+int DANESSL_verify_chain_async(DANESSL_WORKERS *w, SSL *ssl,
+			       STACK_OF(X509) *chain,
+			       void (*cb)(SSL *, int, void *), void *arg)
+{
+    DANEerr(DANESSL_F_VERIFY_CHAIN_ASYNC, DANESSL_R_SUPPORT);
+    return 0;
+}
+
+SSL *DANESSL_WORKERS_done(DANESSL_WORKERS *w, int *ret)
+{
+    return 0;
+}
+#endif
+
+/*
+ * Batch verification.  Each thread verifies its jobs with a connection of
+ * the shared SSL_CTX, whose DANE state comes from the per-thread handle
+ * pool, so jobs share the trust store, verdict cache and any policies, but
+ * nothing mutable beyond those.  The compatibility code leaves nothing in
+ * the connection but its SNI name and verify result, so the connection is
+ * reused for the thread's next job.  OpenSSL's own DANE support, once
+ * enabled, can't be reset, and the connection is then replaced.
+ */
+static void batch_one(SSL_CTX *ctx, DANESSL_VERDICTS *verdicts,
+		      const DANESSL_JOB *job, DANESSL_RESULT *res, SSL **sslp)
+{
+    SSL *ssl = *sslp;
+    int native = 1;
+    int depth;
+
+    res->ret = -1;
+    res->verify_result = X509_V_ERR_UNSPECIFIED;
+    res->depth = -1;
+    if (job->chain == 0 || sk_X509_num(job->chain) <= 0)
+	return;
+
+    /* Errors are reported per-job, the caller's error queue is untouched */
+    ERR_set_mark();
+    if (ssl != 0)
+	(void) SSL_set_tlsext_host_name(ssl, 0);
+    else if ((ssl = SSL_new(ctx)) != 0)
+	SSL_set_connect_state(ssl);
+    if (ssl != 0) {
+	if (DANESSL_init(ssl, job->sni_domain, job->hostnames) > 0) {
+	    native = ((DANESSL *) SSL_get_ex_data(ssl, dane_idx))->native;
+	    if ((verdicts == 0 || DANESSL_set_verdicts(ssl, verdicts) > 0)
+		&& (job->policy ? DANESSL_set_policy(ssl, job->policy) > 0 :
+		    DANESSL_add_tlsa_rrset(ssl, job->rrset, job->nrrs) >= 0)) {
+		res->ret = DANESSL_verify_chain(ssl, job->chain);
+		res->verify_result = SSL_get_verify_result(ssl);
+		if (DANESSL_get_match_cert(ssl, 0, 0, &depth) > 0)
+		    res->depth = depth;
+	    }
+	}
+	DANESSL_cleanup(ssl);
+	if (native) {
+	    SSL_free(ssl);
+	    ssl = 0;
+	}
+    }
+    ERR_pop_to_mark();
+    *sslp = ssl;
+}
+
+#ifdef DANE_ASYNC
+/*
+ * The threads of a batch claim chunks of consecutive jobs from a shared
+ * cursor until none remain.  Jobs of very different cost thus balance out
+ * across threads, without per-thread queues to steal from.
+ */
+#define DANE_BATCH_CHUNK	8
+
+typedef struct dane_batch {
+    pthread_mutex_t	    lock;
+    size_t		    next;	/* First unclaimed job */
+    size_t		    n;
+    SSL_CTX		    *ctx;
+    DANESSL_VERDICTS	    *verdicts;
+    const DANESSL_JOB	    *jobs;
+    DANESSL_RESULT	    *results;
+} dane_batch;
+
+static void batch_work(dane_batch *b)
+{
+    SSL *ssl = 0;
+    size_t i;
+    size_t end;
+
+    for (;;) {
+	pthread_mutex_lock(&b->lock);
+	i = b->next;
+	end = b->n - i > DANE_BATCH_CHUNK ? i + DANE_BATCH_CHUNK : b->n;
+	b->next = end;
+	pthread_mutex_unlock(&b->lock);
+
+	if (i == end)
+	    break;
+	for (/* NOP */; i < end; ++i)
+	    batch_one(b->ctx, b->verdicts, &b->jobs[i], &b->results[i], &ssl);
+    }
+    if (ssl)
+	SSL_free(ssl);
+}
+
+static void *batch_thread(void *arg)
+{
+    batch_work(arg);
+    async_thread_exit();
+    return 0;
+}
+
+/*
+ * The caller's thread works alongside "nthreads - 1" others.  If fewer can
+ * be started, the rest of the jobs are just shared by fewer threads.
+ */
+static void batch_run(dane_batch *b, int nthreads)
+{
+    pthread_t *threads;
+    size_t i;
+    int started = 0;
+    int j;
+
+    /*
+     * As in DANESSL_verify_chain_async(), cache extensions before sharing.
+     * Likewise, freeze the policies now, not as each thread attaches them.
+     */
+    for (i = 0; i < b->n; ++i) {
+	STACK_OF(X509) *chain = b->jobs[i].chain;
+
+	for (j = 0; chain && j < sk_X509_num(chain); ++j)
+	    (void) X509_check_purpose(sk_X509_value(chain, j), -1, 0);
+	if (b->jobs[i].policy)
+	    dane_atomic_set(&b->jobs[i].policy->frozen, 1);
+    }
+
+    pthread_mutex_init(&b->lock, 0);
+    if ((threads = OPENSSL_malloc((nthreads - 1) * sizeof(pthread_t))) != 0)
+	for (/* NOP */; started < nthreads - 1; ++started)
+	    if (pthread_create(&threads[started], 0, batch_thread, b) != 0)
+		break;
+    batch_work(b);
+    for (j = 0; j < started; ++j)
+	pthread_join(threads[j], 0);
+    if (threads)
+	OPENSSL_free(threads);
+    pthread_mutex_destroy(&b->lock);
+}
+#endif
+
+int DANESSL_verify_batch(SSL_CTX *ctx, DANESSL_VERDICTS *verdicts,
+			 const DANESSL_JOB *jobs, DANESSL_RESULT *results,
+			 size_t n, int nthreads)
+{
+    SSL *ssl = 0;
+    size_t i;
+
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_VERIFY_BATCH, DANESSL_R_LIBRARY_INIT);
+	return -1;
+    }
+#ifdef DANE_ASYNC
+    nthreads = async_nthreads(nthreads);
+    if (nthreads > 1 && n > DANE_BATCH_CHUNK) {
+	dane_batch b;
+
+	/* No point in threads with nothing to claim */
+	if ((n - 1) / DANE_BATCH_CHUNK < (size_t) nthreads - 1)
+	    nthreads = (int) ((n - 1) / DANE_BATCH_CHUNK) + 1;
+	b.next = 0;
+	b.n = n;
+	b.ctx = ctx;
+	b.verdicts = verdicts;
+	b.jobs = jobs;
+	b.results = results;
+	batch_run(&b, nthreads);
+	return 1;
+    }
+#endif
+    for (i = 0; i < n; ++i)
+	batch_one(ctx, verdicts, &jobs[i], &results[i], &ssl);
+    if (ssl)
+	SSL_free(ssl);
+    return 1;
+}
+
+
+/*
+ * Validate the fields of a TLSA record, given its digest algorithm (NULL
+ * for full data).  Full certificates and public keys must parse, and, for
+ * DANE-TA(2) records, are returned via "xp" or "kp" for use as trust
+ * anchors.
+ */
+static int tlsa_check(int f, uint8_t usage, uint8_t selector,
+		      const EVP_MD *md, const unsigned char *data, size_t dlen,
+		      X509 **xp, EVP_PKEY **kp)
+{
+    X509 *x = 0;
+    EVP_PKEY *k = 0;
+    const unsigned char *p = data;
+
+    *xp = 0;
+    *kp = 0;
+
+    if (usage > DANESSL_USAGE_LAST) {
+	DANEerr(f, DANESSL_R_BAD_USAGE);
+	return 0;
+    }
+    if (selector > DANESSL_SELECTOR_LAST) {
+	DANEerr(f, DANESSL_R_BAD_SELECTOR);
+	return 0;
+    }
+    if (md && dlen != EVP_MD_size(md)) {
+	DANEerr(f, DANESSL_R_BAD_DATA_LENGTH);
+	return 0;
+    }
+    if (!data) {
+	DANEerr(f, DANESSL_R_BAD_NULL_DATA);
+	return 0;
+    }
+    if (md)
+	return 1;
+
+    /*
+     * Full Certificate or Public Key when NULL or empty digest name
+     */
+    switch (selector) {
+    case DANESSL_SELECTOR_CERT:
+	if (!d2i_X509(&x, &p, dlen) || dlen != p - data) {
+	    if (x)
+		X509_free(x);
+	    DANEerr(f, DANESSL_R_BAD_CERT);
+	    return 0;
+	}
+	k = X509_get_pubkey(x);
+	EVP_PKEY_free(k);
+	if (k == 0) {
+	    X509_free(x);
+	    DANEerr(f, DANESSL_R_BAD_CERT_PKEY);
+	    return 0;
+	}
+	if (usage == DANESSL_USAGE_DANE_TA)
+	    *xp = x;
+	else
+	    X509_free(x);
+	break;
+
+    case DANESSL_SELECTOR_SPKI:
+	if (!d2i_PUBKEY(&k, &p, dlen) || dlen != p - data) {
+	    if (k)
+		EVP_PKEY_free(k);
+	    DANEerr(f, DANESSL_R_BAD_PKEY);
+	    return 0;
+	}
+	if (usage == DANESSL_USAGE_DANE_TA)
+	    *kp = k;
+	else
+	    EVP_PKEY_free(k);
+	break;
+    }
+    return 1;
+}
+
+/*
+ * Record a DANE-TA(2) full certificate or public key as a trust anchor,
+ * taking ownership of it.  Certificates are marked trusted for serverAuth
+ * here, since once the policy is shared they must not be modified.
+ */
+static int tlsa_anchor(DANESSL_POLICY *pol, int f, X509 *x, EVP_PKEY *k)
+{
+    int i;
+
+    if (x) {
+	unsigned long hash = X509_NAME_hash(X509_get_subject_name(x));
+
+	if (!X509_add1_trust_object(x, server_auth)
+	    || !arena_grow(&pol->arena, (void **) &pol->tacerts,
+			   sizeof(*pol->tacerts), pol->ntacerts,
+			   &pol->mtacerts, pol->ntacerts + 1)) {
+	    DANEerr(f, ERR_R_MALLOC_FAILURE);
+	    X509_free(x);
+	    return 0;
+	}
+	for (i = pol->ntacerts; i > 0 && pol->tacerts[i - 1].hash > hash; --i)
+	    pol->tacerts[i] = pol->tacerts[i - 1];
+	pol->tacerts[i].hash = hash;
+	pol->tacerts[i].skid = X509_get0_subject_key_id(x);
+	pol->tacerts[i].cert = x;
+	++pol->ntacerts;
+    } else if (k) {
+	dane_ta_key t;
+	X509_PUBKEY *pub = 0;
+	const unsigned char *bits;
+	int len;
+
+	if (!X509_PUBKEY_set(&pub, k)
+	    || !X509_PUBKEY_get0_param(0, &bits, &len, 0, pub)
+	    || !EVP_Digest(bits, len, t.keyid, 0, EVP_sha1(), 0)
+	    || !arena_grow(&pol->arena, (void **) &pol->takeys,
+			   sizeof(*pol->takeys), pol->ntakeys,
+			   &pol->mtakeys, pol->ntakeys + 1)) {
+	    DANEerr(f, ERR_R_MALLOC_FAILURE);
+	    if (pub)
+		X509_PUBKEY_free(pub);
+	    EVP_PKEY_free(k);
+	    return 0;
+	}
+	X509_PUBKEY_free(pub);
+	t.type = EVP_PKEY_base_id(k);
+	t.pkey = k;
+	for (i = pol->ntakeys; i > 0
+	     && memcmp(pol->takeys[i - 1].keyid, t.keyid,
+		       SHA_DIGEST_LENGTH) > 0;
+	     --i)
+	    pol->takeys[i] = pol->takeys[i - 1];
+	pol->takeys[i] = t;
+	++pol->ntakeys;
+    }
+    return 1;
+}
+
+static int policy_add_tlsa(
+	DANESSL_POLICY *pol,
+	int f,
+	uint8_t usage,
+	uint8_t selector,
+	const char *mdname,
+	unsigned const char *data,
+	size_t dlen
+)
+{
+    dane_table *t;
+    dane_group *g;
+    int pos;
+    X509 *x;
+    EVP_PKEY *k;
+    const EVP_MD *md = 0;
+
+    /* Support built-in standard one-digit mtypes */
+    if (mdname && *mdname && mdname[1] == '\0') 
+	switch (*mdname - '0') {
+	    case DANESSL_MATCHING_FULL: mdname = 0;	   break;
+	    case DANESSL_MATCHING_2256:
+	    case DANESSL_MATCHING_2512:
+		if ((md = mtype_md[*mdname - '0']) == 0) {
+		    DANEerr(f, DANESSL_R_BAD_DIGEST);
+		    return 0;
+		}
+		mdname = 0;
+		break;
+	}
+    if (mdname && *mdname && (md = EVP_get_digestbyname(mdname)) == 0) {
+	DANEerr(f, DANESSL_R_BAD_DIGEST);
+	return 0;
+    }
+    if (!tlsa_check(f, usage, selector, md, data, dlen, &x, &k))
+	return 0;
+
+    /* Find insertion point and don't add duplicate elements. */
+    t = &pol->tables[usage];
+    if ((g = table_group(&pol->arena, t, selector, md, 1)) != 0) {
+	if (group_find(g, data, dlen, &pos)) {
+	    if (x)
+		X509_free(x);
+	    if (k)
+		EVP_PKEY_free(k);
+	    return 1;
+	}
+	if (group_insert(&pol->arena, g, pos, data, dlen)) {
+	    if (!tlsa_anchor(pol, f, x, k))
+		return 0;
+	    ++pol->count;
+	    return 1;
+	}
+	if (g->nent == 0)
+	    table_remove(t, g);
+    }
+    DANEerr(f, ERR_R_MALLOC_FAILURE);
+    if (x)
+	X509_free(x);
+    if (k)
+	EVP_PKEY_free(k);
+    return 0;
+}
+
+typedef struct dane_rr {
+    uint8_t usage;
+    uint8_t selector;
+    uint8_t mtype;
+    const unsigned char *data;
+    size_t dlen;
+    const EVP_MD *md;
+    X509 *x;
+    EVP_PKEY *k;
+} dane_rr;
+
+static int rr_cmp(const void *va, const void *vb)
+{
+    const dane_rr *a = (const dane_rr *) va;
+    const dane_rr *b = (const dane_rr *) vb;
+
+    if (a->usage != b->usage)
+	return a->usage - b->usage;
+    if (a->selector != b->selector)
+	return a->selector - b->selector;
+    if (a->mtype != b->mtype)
+	return a->mtype - b->mtype;
+    if (a->dlen != b->dlen)
+	return a->dlen < b->dlen ? -1 : 1;
+    return memcmp(a->data, b->data, a->dlen);
+}
+
+/*
+ * Merge "n" sorted, distinct records not already in the group "g".
+ */
+static int group_merge(dane_arena *a, dane_group *g, dane_rr *rrs, int n,
+		       int nocopy)
+{
+    int i;
+    int j;
+    int k;
+
+    if (!group_reserve(a, g, n))
+	return 0;
+
+    /*
+     * Merge the new entries into the sorted index from the top down, so
+     * that no entry moves more than once.
+     */
+    for (i = g->nent - 1, j = n - 1, k = g->nent + n - 1; j >= 0; --k) {
+	dane_rr *r = rrs + j;
+
+	if (i >= 0 && entry_cmp(g->ent + i, r->data, r->dlen) > 0) {
+	    g->ent[k] = g->ent[i--];
+	    continue;
+	}
+	if ((g->ent[k].data = arena_data(a, r->data, r->dlen, nocopy)) == 0) {
+	    /* Close the gap, leaving the index sorted */
+	    memmove(g->ent + i + 1, g->ent + k + 1,
+		    (g->nent + n - k - 1) * sizeof(*g->ent));
+	    g->nent += n - j - 1;
+	    return 0;
 	}
+	g->ent[k].len = r->dlen;
+	--j;
     }
-    return matched;
+    g->nent += n;
+    return 1;
 }
 
-static int match_name(const char *certid, DANESSL *dane)
+/*
+ * Load the usable records from "rrs", which the caller has filled in with
+ * each record's fields.  Returns the number of records added, or -1 on
+ * error.
+ */
+static int tlsa_load(DANESSL_POLICY *pol, int f, dane_rr *rrs, int n,
+		     int nocopy)
 {
-    int multi = dane->multi;
-    DANE_HOST_LIST hosts = dane->hosts;
+    size_t space = 0;
+    int ngood = 0;
+    int added = 0;
+    int ret = -1;
+    int i;
+    int j;
 
-    for (/* NOP */; hosts; hosts = hosts->next) {
-	int match_subdomain = 0;
-	const char *domain = hosts->value;
-	const char *parent;
-	int idlen;
-	int domlen;
+    /*
+     * Unusable records are ignored, as RFC 7671 requires, so any errors
+     * they raise are not left on the error stack.
+     */
+    ERR_set_mark();
+    for (i = 0; i < n; ++i) {
+	dane_rr *r = rrs + ngood;
+
+	*r = rrs[i];
+	if (r->mtype > DANESSL_MATCHING_LAST
+	    || (r->mtype != DANESSL_MATCHING_FULL
+		&& (r->md = mtype_md[r->mtype]) == 0))
+	    continue;
+	if (r->mtype == DANESSL_MATCHING_FULL)
+	    r->md = 0;
+	if (tlsa_check(f, r->usage, r->selector, r->md, r->data, r->dlen,
+		       &r->x, &r->k))
+	    ++ngood;
+    }
+    ERR_pop_to_mark();
 
-	if (*domain == '.' && domain[1] != '\0') {
-	    ++domain;
-	    match_subdomain = 1;
+    /*
+     * Sort the usable records, which places each (usage, selector, mtype)
+     * group in a contiguous run, in the same order as the group's index.
+     * Drop duplicates within the RRset, and records already loaded.
+     */
+    qsort(rrs, ngood, sizeof(*rrs), rr_cmp);
+    for (i = j = 0; i < ngood; ++i) {
+	dane_rr *r = rrs + i;
+	dane_group *g;
+
+	g = table_group(&pol->arena, &pol->tables[r->usage], r->selector,
+			r->md, 0);
+	if ((j > 0 && rr_cmp(rrs + j - 1, r) == 0)
+	    || (g && group_find(g, r->data, r->dlen, 0))) {
+	    if (r->x)
+		X509_free(r->x);
+	    if (r->k)
+		EVP_PKEY_free(r->k);
+	    continue;
 	}
+	space += sizeof(dane_entry);
+	if (!nocopy)
+	    space += DANE_ARENA_ROUND(r->dlen);
+	rrs[j++] = *r;
+    }
+    ngood = j;
 
-	/*
-	 * Sub-domain match: certid is any sub-domain of hostname.
-	 */
-	if (match_subdomain) {
-	    if ((idlen = strlen(certid)) > (domlen = strlen(domain)) + 1
-		&& certid[idlen - domlen - 1] == '.'
-		&& !strcasecmp(certid + (idlen - domlen), domain))
-		return 1;
-	    else
-		continue;
+    /*
+     * Reserve room for all the new data at once, with a generous allowance
+     * for the indices and any new groups, then merge each run.
+     */
+    if (!arena_reserve(&pol->arena, 2 * space + 4 * sizeof(dane_group)
+		       * (DANESSL_USAGE_LAST + 1)
+		       * (DANESSL_SELECTOR_LAST + 1))) {
+	DANEerr(f, ERR_R_MALLOC_FAILURE);
+	goto done;
+    }
+    for (i = 0; i < ngood; i = j) {
+	dane_rr *r = rrs + i;
+	dane_table *t = &pol->tables[r->usage];
+	dane_group *g;
+
+	for (j = i + 1; j < ngood; ++j)
+	    if (rrs[j].usage != r->usage || rrs[j].selector != r->selector
+		|| rrs[j].md != r->md)
+		break;
+	if ((g = table_group(&pol->arena, t, r->selector, r->md, 1)) == 0
+	    || !group_merge(&pol->arena, g, r, j - i, nocopy)) {
+	    DANEerr(f, ERR_R_MALLOC_FAILURE);
+	    if (g && g->nent == 0)
+		table_remove(t, g);
+	    goto done;
+	}
+	for (/* NOP */; i < j; ++i, ++added) {
+	    X509 *x = rrs[i].x;
+	    EVP_PKEY *k = rrs[i].k;
+
+	    rrs[i].x = 0;
+	    rrs[i].k = 0;
+	    if (!tlsa_anchor(pol, f, x, k))
+		goto done;
+	    ++pol->count;
 	}
-
-	/*
-	 * Exact match and initial "*" match. The initial "*" in a certid
-	 * matches one (if multi is false) or more hostname components under
-	 * the condition that the certid contains multiple hostname components.
-	 */
-	if (!strcasecmp(certid, domain)
-	    || (certid[0] == '*' && certid[1] == '.' && certid[2] != 0
-		&& (parent = strchr(domain, '.')) != 0
-		&& (idlen = strlen(certid + 1)) <= (domlen = strlen(parent))
-		&& strcasecmp(multi ? parent + domlen - idlen : parent,
-			      certid + 1) == 0))
-	    return 1;
     }
-    return 0;
-}
-
-static const char *check_name(const char *name, int len)
-{
-    register const char *cp = name + len;
-
-    while (len > 0 && *--cp == 0)
-	--len;				/* Ignore trailing NULs */
-    if (len <= 0)
-	return 0;
-    for (cp = name; *cp; cp++) {
-	register char c = *cp;
-	if (!((c >= 'a' && c <= 'z') ||
-	      (c >= '0' && c <= '9') ||
-	      (c >= 'A' && c <= 'Z') ||
-	      (c == '.' || c == '-') ||
-	      (c == '*')))
-	    return 0;			/* Only LDH, '.' and '*' */
+    ret = added;
+
+  done:
+    for (i = 0; i < ngood; ++i) {
+	if (rrs[i].x)
+	    X509_free(rrs[i].x);
+	if (rrs[i].k)
+	    EVP_PKEY_free(rrs[i].k);
     }
-    if (cp - name != len)		/* Guard against internal NULs */
-	return 0;
-    return name;
-}
-
-static const char *parse_dns_name(const GENERAL_NAME *gn)
-{
-    if (gn->type != GEN_DNS)
-	return 0;
-    if (ASN1_STRING_type(gn->d.ia5) != V_ASN1_IA5STRING)
-	return 0;
-    return check_name((const char *)ASN1_STRING_get0_data(gn->d.ia5),
-		      ASN1_STRING_length(gn->d.ia5));
+    return ret;
 }
 
-static char *parse_subject_name(X509 *cert)
+static int rrset_load(DANESSL_POLICY *pol, int f, const DANESSL_TLSA *rrset,
+		      size_t n)
 {
-    X509_NAME *name = X509_get_subject_name(cert);
-    X509_NAME_ENTRY *entry;
-    ASN1_STRING *entry_str;
-    unsigned char *namebuf;
-    int nid = NID_commonName;
-    int len;
+    dane_rr *rrs;
+    int ret;
     int i;
 
-    if (name == 0 || (i = X509_NAME_get_index_by_NID(name, nid, -1)) < 0)
-	return 0;
-    if ((entry = X509_NAME_get_entry(name, i)) == 0)
-	return 0;
-    if ((entry_str = X509_NAME_ENTRY_get_data(entry)) == 0)
-	return 0;
-
-    if ((len = ASN1_STRING_to_UTF8(&namebuf, entry_str)) < 0)
-	return 0;
-    if (len <= 0 || check_name((char *) namebuf, len) == 0) {
-	OPENSSL_free(namebuf);
+    if (n == 0)
 	return 0;
+    if (n > INT_MAX / sizeof(*rrs)
+	|| (rrs = OPENSSL_malloc(n * sizeof(*rrs))) == 0) {
+	DANEerr(f, ERR_R_MALLOC_FAILURE);
+	return -1;
     }
-    return (char *) namebuf;
+    for (i = 0; i < n; ++i) {
+	rrs[i].usage = rrset[i].usage;
+	rrs[i].selector = rrset[i].selector;
+	rrs[i].mtype = rrset[i].mtype;
+	rrs[i].data = rrset[i].data;
+	rrs[i].dlen = rrset[i].dlen;
+    }
+    ret = tlsa_load(pol, f, rrs, n, 0);
+    OPENSSL_free(rrs);
+    return ret;
 }
 
-static int name_check(DANESSL *dane, X509 *cert)
+static int rdata_load(DANESSL_POLICY *pol, int f,
+		      const unsigned char *const *rdata, const size_t *rdlen,
+		      size_t n, int flags)
 {
-    int matched = 0;
-    int got_altname = 0;
-    GENERAL_NAMES *gens;
-
-    gens = X509_get_ext_d2i(cert, NID_subject_alt_name, 0, 0);
-    if (gens) {
-	int n = sk_GENERAL_NAME_num(gens);
-	int i;
-
-	for (i = 0; i < n; ++i) {
-	    const GENERAL_NAME *gn = sk_GENERAL_NAME_value(gens, i);
-	    const char *certid;
+    dane_rr *rrs;
+    int nrr = 0;
+    int ret;
+    int i;
 
-	    if (gn->type != GEN_DNS)
-		continue;
-	    got_altname = 1;
-	    certid = parse_dns_name(gn);
-	    if (certid && *certid) {
-		if ((matched = match_name(certid, dane)) == 0)
-		    continue;
-		if ((dane->mhost = OPENSSL_strdup(certid)) == 0)
-		    matched = -1;
-		break;
-	    }
-	}
-	GENERAL_NAMES_free(gens);
+    if (n == 0)
+	return 0;
+    if (n > INT_MAX / sizeof(*rrs)
+	|| (rrs = OPENSSL_malloc(n * sizeof(*rrs))) == 0) {
+	DANEerr(f, ERR_R_MALLOC_FAILURE);
+	return -1;
     }
 
     /*
-     * XXX: Should the subjectName be skipped when *any* altnames are present,
-     * or only when DNS altnames are present?
+     * TLSA RDATA is the usage, selector and matching type octets, followed
+     * by the association data, which is used in place.  RDATA too short to
+     * hold any association data is unusable, and skipped.
      */
-    if (got_altname == 0) {
-	char *certid = parse_subject_name(cert);
-	if (certid != 0 && *certid
-	    && (matched = match_name(certid, dane)) != 0)
-	    dane->mhost = OPENSSL_strdup(certid);
-	if (certid)
-	    OPENSSL_free(certid);
+    for (i = 0; i < n; ++i) {
+	const unsigned char *rd = rdata[i];
+
+	if (rd == 0 || rdlen[i] < 4)
+	    continue;
+	rrs[nrr].usage = rd[0];
+	rrs[nrr].selector = rd[1];
+	rrs[nrr].mtype = rd[2];
+	rrs[nrr].data = rd + 3;
+	rrs[nrr].dlen = rdlen[i] - 3;
+	++nrr;
     }
-    return matched;
+    ret = tlsa_load(pol, f, rrs, nrr, flags & DANESSL_RDATA_NOCOPY);
+    OPENSSL_free(rrs);
+    return ret;
 }
 
-static int verify_chain(X509_STORE_CTX *ctx)
+/*
+ * Return the policy to which records for the connection are added,
+ * creating a private one when the connection has none.  A shared policy
+ * can't be changed, nor can the records of a connection once it has
+ * verified a chain.
+ */
+static DANESSL_POLICY *ssl_policy(SSL *ssl, int f)
 {
-    DANE_SELECTOR_LIST issuer_rrs;
-    DANE_SELECTOR_LIST leaf_rrs;
-    int (*cb)(int, X509_STORE_CTX *) = X509_STORE_CTX_get_verify_cb(ctx);
-    int ssl_idx = SSL_get_ex_data_X509_STORE_CTX_idx();
-    SSL *ssl = X509_STORE_CTX_get_ex_data(ctx, ssl_idx);
-    DANESSL *dane = SSL_get_ex_data(ssl, dane_idx);
-    X509 *cert = X509_STORE_CTX_get0_cert(ctx);
-    STACK_OF(X509) *chain = X509_STORE_CTX_get0_chain(ctx);
-    int chain_length = sk_X509_num(chain);
-    int matched = 0;
-
-    issuer_rrs = dane->selectors[DANESSL_USAGE_PKIX_TA];
-    leaf_rrs = dane->selectors[DANESSL_USAGE_PKIX_EE];
-
-    /* Restore OpenSSL's internal_verify() as the signature check function */
-    X509_STORE_CTX_set_verify(ctx, dane->verify);
+    DANESSL *dane;
 
-    if ((matched = name_check(dane, cert)) < 0) {
-	X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
+    if (!dane_ready_get() || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0) {
+	DANEerr(f, DANESSL_R_INIT);
 	return 0;
     }
+    if (dane->fixed) {
+	DANEerr(f, DANESSL_R_RECORDS_FIXED);
+	return 0;
+    }
+    if (dane->policy == &no_policy) {
+	DANESSL_POLICY *pol = DANESSL_POLICY_new();
 
-    if (!matched) {
-	X509_STORE_CTX_set_error_depth(ctx, 0);
-	X509_STORE_CTX_set_current_cert(ctx, cert);
-	X509_STORE_CTX_set_error(ctx, X509_V_ERR_HOSTNAME_MISMATCH);
-	if (!cb(0, ctx))
+	if (pol == 0)
 	    return 0;
+	dane->policy = pol;
     }
-    matched = 0;
-
-    /*
-     * Satisfy at least one usage 0 or 1 constraint, unless we've already
-     * matched a usage 2 trust anchor.
-     *
-     * XXX: internal_verify() doesn't callback with top certs that are not
-     * self-issued.  This is fixed in OpenSSL 1.1.0.
-     */
-    if (dane->roots && sk_X509_num(dane->roots)) {
-	X509 *top = sk_X509_value(chain, dane->depth);
+    if (dane_atomic_get(&dane->policy->frozen)) {
+	DANEerr(f, DANESSL_R_POLICY_FROZEN);
+	return 0;
+    }
+    return dane->policy;
+}
 
-	dane->mdpth = dane->depth;
-	dane->match = top;
-	X509_up_ref(top);
+int DANESSL_add_tlsa(
+	SSL *ssl,
+	uint8_t usage,
+	uint8_t selector,
+	const char *mdname,
+	unsigned const char *data,
+	size_t dlen
+)
+{
+    DANESSL_POLICY *pol = ssl_policy(ssl, DANESSL_F_ADD_TLSA);
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-	if (X509_check_issued(top, top) != X509_V_OK) {
-	    X509_STORE_CTX_set_error_depth(ctx, dane->depth);
-	    X509_STORE_CTX_set_current_cert(ctx, top);
-	    if (!cb(1, ctx))
-		return 0;
-	}
-#endif
-	/* Pop synthetic trust-anchor ancestors off the chain! */
-	while (--chain_length > dane->depth)
-	    X509_free(sk_X509_pop(chain));
-    } else {
-	int n = 0;
-	X509 *xn = cert;
+    if (pol == 0)
+	return -1;
+    return policy_add_tlsa(pol, DANESSL_F_ADD_TLSA, usage, selector, mdname,
+			   data, dlen);
+}
 
-	/*
-	 * Check for an EE match, then a CA match at depths > 0, and
-	 * finally, if the EE cert is self-issued, for a depth 0 CA match.
-	 */
-	if (leaf_rrs)
-	    matched = match(leaf_rrs, xn, 0);
-	if (!matched && issuer_rrs) {
-	    for (n = chain_length-1; !matched && n >= 0; --n) {
-		xn = sk_X509_value(chain, n);
-		if (n > 0 || X509_check_issued(xn, xn) == X509_V_OK)
-		    matched = match(issuer_rrs, xn, n);
-	    }
-	}
+int DANESSL_add_tlsa_rrset(SSL *ssl, const DANESSL_TLSA *rrset, size_t n)
+{
+    DANESSL_POLICY *pol = ssl_policy(ssl, DANESSL_F_ADD_TLSA_RRSET);
 
-	if (matched < 0) {
-	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
-	    return 0;
-	}
+    if (pol == 0)
+	return -1;
+    return rrset_load(pol, DANESSL_F_ADD_TLSA_RRSET, rrset, n);
+}
 
-	if (!matched) {
-	    X509_STORE_CTX_set_current_cert(ctx, cert);
-	    X509_STORE_CTX_set_error_depth(ctx, 0);
-	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_CERT_UNTRUSTED);
-	    if (!cb(0, ctx))
-		return 0;
-	} else {
-	    dane->mdpth = n;
-	    dane->match = xn;
-	    X509_up_ref(xn);
-	}
-    }
+int DANESSL_add_tlsa_rdata(
+	SSL *ssl,
+	const unsigned char *const *rdata,
+	const size_t *rdlen,
+	size_t n,
+	int flags
+)
+{
+    DANESSL_POLICY *pol = ssl_policy(ssl, DANESSL_F_ADD_TLSA_RDATA);
 
-    /* Tail recurse into OpenSSL's internal_verify */
-    return dane->verify(ctx);
+    if (pol == 0)
+	return -1;
+    return rdata_load(pol, DANESSL_F_ADD_TLSA_RDATA, rdata, rdlen, n, flags);
 }
 
-static void dane_reset(DANESSL *dane)
+DANESSL_POLICY *DANESSL_POLICY_new(void)
 {
-    dane->depth = -1;
-    if (dane->mhost) {
-	OPENSSL_free(dane->mhost);
-	dane->mhost = 0;
-    }
-    if (dane->roots) {
-	sk_X509_pop_free(dane->roots, X509_free);
-	dane->roots = 0;
+    DANESSL_POLICY *pol;
+
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_POLICY_NEW, DANESSL_R_LIBRARY_INIT);
+	return 0;
     }
-    if (dane->chain) {
-	sk_X509_pop_free(dane->chain, X509_free);
-	dane->chain = 0;
+    if ((pol = OPENSSL_malloc(sizeof(*pol))) == 0) {
+	DANEerr(DANESSL_F_POLICY_NEW, ERR_R_MALLOC_FAILURE);
+	return 0;
     }
-    if (dane->match) {
-	X509_free(dane->match);
-	dane->match = 0;
+    memset(pol, 0, sizeof(*pol));
+    pol->references = 1;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    if ((pol->lock = CRYPTO_THREAD_lock_new()) == 0) {
+	DANEerr(DANESSL_F_POLICY_NEW, ERR_R_MALLOC_FAILURE);
+	OPENSSL_free(pol);
+	return 0;
     }
-    dane->mdpth = -1;
+#endif
+    return pol;
 }
 
-static
-int verify_cert(X509_STORE_CTX *ctx, void *unused_ctx)
+static int policy_ref(DANESSL_POLICY *pol, int n)
 {
-    static int ssl_idx = -1;
-    SSL *ssl;
-    DANESSL *dane;
-    int (*cb)(int, X509_STORE_CTX *) = X509_STORE_CTX_get_verify_cb(ctx);
-    X509 *cert = X509_STORE_CTX_get0_cert(ctx);
-    int matched;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    return CRYPTO_add(&pol->references, n, CRYPTO_LOCK_SSL_CTX);
+#else
+    int ret;
 
-    if (ssl_idx < 0)
-	ssl_idx = SSL_get_ex_data_X509_STORE_CTX_idx();
-    if (dane_idx < 0) {
-	DANEerr(DANESSL_F_VERIFY_CERT, ERR_R_MALLOC_FAILURE);
-	return -1;
-    }
+    (void) CRYPTO_atomic_add(&pol->references, n, &ret, pol->lock);
+    return ret;
+#endif
+}
 
-    ssl = X509_STORE_CTX_get_ex_data(ctx, ssl_idx);
-    if ((dane = SSL_get_ex_data(ssl, dane_idx)) == 0 || cert == 0)
-	return X509_verify_cert(ctx);
+int DANESSL_POLICY_up_ref(DANESSL_POLICY *pol)
+{
+    return policy_ref(pol, 1) > 1;
+}
 
-    /* Reset for verification of a new chain, perhaps a renegotiation. */
-    dane_reset(dane);
+void DANESSL_POLICY_free(DANESSL_POLICY *pol)
+{
+    int i;
 
-    if (dane->selectors[DANESSL_USAGE_DANE_EE]) {
-	if ((matched = check_end_entity(ctx, dane, cert)) > 0) {
-	    X509_STORE_CTX_set_error_depth(ctx, 0);
-	    X509_STORE_CTX_set_current_cert(ctx, cert);
-	    return cb(1, ctx);
-	}
-	if (matched < 0) {
-	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
-	    return -1;
-	}
-	/* Fail now, if all we have is DANE-EE TLSA records */
-	if (!matched
-	    && !dane->selectors[DANESSL_USAGE_DANE_TA]
-	    && !dane->selectors[DANESSL_USAGE_PKIX_EE]
-	    && !dane->selectors[DANESSL_USAGE_PKIX_TA]) {
-	    X509_STORE_CTX_set_current_cert(ctx, cert);
-	    X509_STORE_CTX_set_error_depth(ctx, 0);
-	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_CERT_UNTRUSTED);
-	    return cb(0, ctx);
-	}
-    }
+    if (pol == 0 || pol == &no_policy || policy_ref(pol, -1) > 0)
+	return;
 
-    if (dane->selectors[DANESSL_USAGE_DANE_TA]) {
-	if ((matched = set_trust_anchor(ctx, dane, cert)) < 0) {
-	    X509_STORE_CTX_set_error(ctx, X509_V_ERR_OUT_OF_MEM);
-	    return -1;
-	}
-	if (matched) {
-	    /*
-	     * Check that setting the untrusted chain updates the expected
-	     * structure member at the expected offset.
-	     */
-	    X509_STORE_CTX_set0_trusted_stack(ctx, dane->roots);
-	    X509_STORE_CTX_set0_untrusted(ctx, dane->chain);
-	    OPENSSL_assert(dane->chain == X509_STORE_CTX_get0_untrusted(ctx));
-	}
+    for (i = 0; i < pol->ntacerts; ++i)
+	X509_free(pol->tacerts[i].cert);
+    for (i = 0; i < pol->ntakeys; ++i)
+	EVP_PKEY_free(pol->takeys[i].pkey);
+    arena_free(&pol->arena);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    CRYPTO_THREAD_lock_free(pol->lock);
+#endif
+    OPENSSL_free(pol);
+}
+
+/*
+ * Adding records to a policy is only possible until it is first attached
+ * to a connection.
+ */
+static int policy_check(DANESSL_POLICY *pol, int f)
+{
+    if (dane_atomic_get(&pol->frozen)) {
+	DANEerr(f, DANESSL_R_POLICY_FROZEN);
+	return 0;
     }
+    return 1;
+}
 
-    /*
-     * Name checks and usage 0/1 constraint enforcement are delayed until
-     * X509_verify_cert() builds the full chain and calls our verify_chain()
-     * wrapper.
-     */
-    dane->verify = X509_STORE_CTX_get_verify(ctx);
-    X509_STORE_CTX_set_verify(ctx, verify_chain);
+int DANESSL_POLICY_add_tlsa(
+	DANESSL_POLICY *pol,
+	uint8_t usage,
+	uint8_t selector,
+	const char *mdname,
+	unsigned const char *data,
+	size_t dlen
+)
+{
+    if (!policy_check(pol, DANESSL_F_POLICY_ADD))
+	return -1;
+    return policy_add_tlsa(pol, DANESSL_F_POLICY_ADD, usage, selector,
+			   mdname, data, dlen);
+}
 
-    if (X509_verify_cert(ctx))
-	return 1;
+int DANESSL_POLICY_add_tlsa_rrset(
+	DANESSL_POLICY *pol,
+	const DANESSL_TLSA *rrset,
+	size_t n
+)
+{
+    if (!policy_check(pol, DANESSL_F_POLICY_ADD))
+	return -1;
+    return rrset_load(pol, DANESSL_F_POLICY_ADD, rrset, n);
+}
 
-    /*
-     * If the chain is invalid, clear any matching cert or hostname, to
-     * protect callers that might erroneously rely on these alone without
-     * checking the validation status.
-     */
-    if (dane->match) {
-	X509_free(dane->match);
-	dane->match = 0;
-    }
-    if (dane->mhost) {
-	OPENSSL_free(dane->mhost);
-	dane->mhost = 0;
-    }
-    return 0;
+int DANESSL_POLICY_add_tlsa_rdata(
+	DANESSL_POLICY *pol,
+	const unsigned char *const *rdata,
+	const size_t *rdlen,
+	size_t n,
+	int flags
+)
+{
+    if (!policy_check(pol, DANESSL_F_POLICY_ADD))
+	return -1;
+    return rdata_load(pol, DANESSL_F_POLICY_ADD, rdata, rdlen, n, flags);
 }
 
-static dane_list list_alloc(size_t vsize)
+int DANESSL_set_policy(SSL *ssl, DANESSL_POLICY *pol)
 {
-    void *value = (void *) OPENSSL_malloc(vsize);
-    dane_list l;
+    DANESSL *dane;
 
-    if (value == 0) {
-	DANEerr(DANESSL_F_LIST_ALLOC, ERR_R_MALLOC_FAILURE);
+    if (!dane_ready_get() || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0) {
+	DANEerr(DANESSL_F_SET_POLICY, DANESSL_R_INIT);
+	return -1;
+    }
+    if (dane->fixed) {
+	DANEerr(DANESSL_F_SET_POLICY, DANESSL_R_RECORDS_FIXED);
 	return 0;
     }
-    if ((l = (dane_list) OPENSSL_malloc(sizeof(*l))) == 0) {
-	OPENSSL_free(value);
-	DANEerr(DANESSL_F_LIST_ALLOC, ERR_R_MALLOC_FAILURE);
+    /* Private policies are never frozen, shared ones always are. */
+    if (dane->policy->count > 0 && !dane_atomic_get(&dane->policy->frozen)) {
+	DANEerr(DANESSL_F_SET_POLICY, DANESSL_R_RECORDS_PRIVATE);
 	return 0;
     }
-    l->next = 0;
-    l->value = value;
-    return l;
+    if (pol == 0)
+	pol = &no_policy;
+    else if (!DANESSL_POLICY_up_ref(pol))
+	return 0;
+    else if (!dane_atomic_get(&pol->frozen))	/* Not if already shared */
+	dane_atomic_set(&pol->frozen, 1);
+
+    DANESSL_POLICY_free(dane->policy);
+    dane->policy = pol;
+    return 1;
+}
+
+/*
+ * Approximate memory footprint of a policy, charged against the cache
+ * budget.
+ */
+static size_t policy_size(DANESSL_POLICY *pol)
+{
+    size_t size = sizeof(*pol);
+    dane_arena_block *b;
+    int i;
+
+    for (b = pol->arena.head; b; b = b->next)
+	size += DANE_ARENA_HDR + b->size;
+    for (i = 0; i < pol->ntacerts; ++i)
+	size += 2 * i2d_X509(pol->tacerts[i].cert, 0);
+    for (i = 0; i < pol->ntakeys; ++i)
+	size += 2 * i2d_PUBKEY(pol->takeys[i].pkey, 0);
+    return size;
 }
 
-static void list_free(void *list, void (*f)(void *))
+/*
+ * Move the tables of a policy into a single block of just the size they
+ * need, releasing the slack, and the superseded copies of grown arrays, of
+ * the blocks they were built in.  As the data moves, the policy must not
+ * yet be shared.
+ */
+static void policy_compact(DANESSL_POLICY *pol)
 {
-    dane_list head = (dane_list) list;
-    dane_list next;
+    dane_arena old = pol->arena;
+    dane_arena_block *b;
+    size_t size = 0;
+    size_t need = 0;
+    int u;
+    int i;
+    int j;
 
-    for (/* NOP */; head; head = next) {
-	next = head->next;
-	if (f && head->value)
-	    f(head->value);
-	OPENSSL_free(head);
+    for (b = old.head; b; b = b->next)
+	size += b->size;
+    for (u = 0; u <= DANESSL_USAGE_LAST; ++u) {
+	dane_table *t = &pol->tables[u];
+
+	need += DANE_ARENA_ROUND(t->ngroups * sizeof(*t->groups));
+	for (i = 0; i < t->ngroups; ++i) {
+	    dane_group *g = &t->groups[i];
+
+	    need += DANE_ARENA_ROUND(g->nent * sizeof(*g->ent));
+	    for (j = 0; j < g->nent; ++j)
+		if (arena_owns(&old, g->ent[j].data))
+		    need += DANE_ARENA_ROUND(g->ent[j].len);
+	}
+    }
+    need += DANE_ARENA_ROUND(pol->ntacerts * sizeof(*pol->tacerts));
+    need += DANE_ARENA_ROUND(pol->ntakeys * sizeof(*pol->takeys));
+    if (need >= size || (b = OPENSSL_malloc(DANE_ARENA_HDR + need)) == 0)
+	return;
+    b->size = need;
+    b->used = 0;
+    b->next = 0;
+    pol->arena.head = b;
+
+    for (u = 0; u <= DANESSL_USAGE_LAST; ++u) {
+	dane_table *t = &pol->tables[u];
+
+	t->groups = arena_move(&pol->arena, t->groups,
+			       t->ngroups * sizeof(*t->groups));
+	t->mgroups = t->ngroups;
+	for (i = 0; i < t->ngroups; ++i) {
+	    dane_group *g = &t->groups[i];
+
+	    g->ent = arena_move(&pol->arena, g->ent, g->nent * sizeof(*g->ent));
+	    g->ment = g->nent;
+	    for (j = 0; j < g->nent; ++j)
+		if (arena_owns(&old, g->ent[j].data))
+		    g->ent[j].data = arena_move(&pol->arena, g->ent[j].data,
+						g->ent[j].len);
+	}
     }
+    pol->tacerts = arena_move(&pol->arena, pol->tacerts,
+			      pol->ntacerts * sizeof(*pol->tacerts));
+    pol->mtacerts = pol->ntacerts;
+    pol->takeys = arena_move(&pol->arena, pol->takeys,
+			     pol->ntakeys * sizeof(*pol->takeys));
+    pol->mtakeys = pol->ntakeys;
+    arena_free(&old);
 }
 
-static void ossl_free(void *p)
+/*
+ * Cache of compiled policies keyed by TLSA base domain.  The cache is split
+ * into shards, selected by the hash of the domain, each with its own lock,
+ * hash table and LRU list, so that concurrent lookups of different domains
+ * rarely contend.  Lookups take only a read lock, and just flag the entry
+ * as used, the LRU list is reordered lazily by the next eviction, which
+ * gives flagged entries another pass instead.  Expired entries are left in
+ * place until replaced or evicted.  The memory budget is shared by all the
+ * shards, when an addition exceeds it entries are evicted first from the
+ * shard that grew, and then from the others in turn.
+ */
+typedef struct dane_cache_entry {
+    struct dane_cache_entry *chain;	/* Hash bucket chain */
+    struct dane_cache_entry *prev;	/* LRU list, most recent first */
+    struct dane_cache_entry *next;
+    DANESSL_POLICY *policy;
+    time_t	    expires;
+    size_t	    size;
+    uint32_t	    hash;
+    dane_atomic	    used;		/* Looked up since last queued */
+    char	    domain[1];		/* Lower-case, no trailing '.' */
+} dane_cache_entry;
+
+/*
+ * OpenSSL before 1.1.0 has no lock objects to allocate, POSIX read-write
+ * locks stand in where available, and failing those all the shards share
+ * the session cache lock.  That lock then also serializes all updates of
+ * the cache memory use, which otherwise has a lock of its own, nested
+ * within that of a shard.
+ */
+typedef struct dane_cache_lock {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    CRYPTO_RWLOCK    *lock;
+#elif defined(DANE_ASYNC)
+    pthread_rwlock_t lock;
+    int		     ok;
+#else
+    int		     unused;
+#endif
+} dane_cache_lock;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define cache_lock_new(l) (((l)->lock = CRYPTO_THREAD_lock_new()) != 0)
+#define cache_lock_free(l) CRYPTO_THREAD_lock_free((l)->lock)
+#define shard_rlock(s) CRYPTO_THREAD_read_lock((s)->lock.lock)
+#define shard_runlock(s) CRYPTO_THREAD_unlock((s)->lock.lock)
+#define shard_wlock(s) CRYPTO_THREAD_write_lock((s)->lock.lock)
+#define shard_wunlock(s) CRYPTO_THREAD_unlock((s)->lock.lock)
+#define bytes_lock(c) CRYPTO_THREAD_write_lock((c)->lock.lock)
+#define bytes_unlock(c) CRYPTO_THREAD_unlock((c)->lock.lock)
+#elif defined(DANE_ASYNC)
+#define cache_lock_new(l) ((l)->ok = pthread_rwlock_init(&(l)->lock, 0) == 0)
+#define cache_lock_free(l) \
+	((l)->ok ? (void) pthread_rwlock_destroy(&(l)->lock) : (void) 0)
+#define shard_rlock(s) pthread_rwlock_rdlock(&(s)->lock.lock)
+#define shard_runlock(s) pthread_rwlock_unlock(&(s)->lock.lock)
+#define shard_wlock(s) pthread_rwlock_wrlock(&(s)->lock.lock)
+#define shard_wunlock(s) pthread_rwlock_unlock(&(s)->lock.lock)
+#define bytes_lock(c) pthread_rwlock_wrlock(&(c)->lock.lock)
+#define bytes_unlock(c) pthread_rwlock_unlock(&(c)->lock.lock)
+#else
+#define cache_lock_new(l) 1
+#define cache_lock_free(l) ((void) 0)
+#define shard_rlock(s) CRYPTO_r_lock(CRYPTO_LOCK_SSL_SESSION)
+#define shard_runlock(s) CRYPTO_r_unlock(CRYPTO_LOCK_SSL_SESSION)
+#define shard_wlock(s) CRYPTO_w_lock(CRYPTO_LOCK_SSL_SESSION)
+#define shard_wunlock(s) CRYPTO_w_unlock(CRYPTO_LOCK_SSL_SESSION)
+#define bytes_lock(c) ((void) 0)
+#define bytes_unlock(c) ((void) 0)
+#endif
+
+typedef struct dane_cache_shard {
+    dane_cache_lock  lock;
+    dane_cache_entry **buckets;
+    size_t	     nbuckets;		/* Power of 2 */
+    size_t	     nentries;
+    dane_cache_entry *head;		/* Most recently queued */
+    dane_cache_entry *tail;		/* Next to evict */
+} dane_cache_shard;
+
+#define DANE_CACHE_SHARDS	16	/* Power of 2 */
+#define DANE_CACHE_BUCKETS	64	/* Initial per-shard buckets */
+
+struct DANESSL_CACHE {
+    size_t	     budget;		/* Memory budget */
+    size_t	     bytes;		/* Memory in use */
+    dane_cache_lock  lock;		/* Of "bytes" */
+    dane_cache_shard shards[DANE_CACHE_SHARDS];
+};
+
+/*
+ * Case-insensitive FNV-1a hash of a domain, ignoring any trailing '.'.
+ * Returns the length of the name as hashed.
+ */
+static size_t domain_hash(const char *domain, uint32_t *hash)
 {
-    OPENSSL_free(p);
+    size_t len = strlen(domain);
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    if (len > 0 && domain[len - 1] == '.')
+	--len;
+    for (i = 0; i < len; ++i) {
+	unsigned char c = domain[i];
+
+	if (c >= 'A' && c <= 'Z')
+	    c += 'a' - 'A';
+	h = (h ^ c) * 16777619U;
+    }
+    *hash = h;
+    return len;
 }
 
-static void dane_mtype_free(void *p)
+static dane_cache_entry **cache_bucket(dane_cache_shard *s, uint32_t hash)
 {
-    list_free(((dane_mtype) p)->data, ossl_free);
-    OPENSSL_free(p);
+    /* The low bits select the shard, use the high bits here. */
+    return &s->buckets[(hash >> 16) & (s->nbuckets - 1)];
 }
 
-static void dane_selector_free(void *p)
+static dane_cache_entry **cache_find(dane_cache_shard *s, uint32_t hash,
+				     const char *domain, size_t len)
 {
-    list_free(((dane_selector) p)->mtype, dane_mtype_free);
-    OPENSSL_free(p);
+    dane_cache_entry **ep;
+
+    for (ep = cache_bucket(s, hash); *ep; ep = &(*ep)->chain)
+	if ((*ep)->hash == hash
+	    && strncasecmp((*ep)->domain, domain, len) == 0
+	    && (*ep)->domain[len] == '\0')
+	    break;
+    return ep;
 }
 
-void DANESSL_cleanup(SSL *ssl)
+static void lru_unlink(dane_cache_shard *s, dane_cache_entry *e)
 {
-    DANESSL *dane;
-    int u;
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	s->head = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	s->tail = e->prev;
+    e->prev = e->next = 0;
+}
 
-    if (dane_idx < 0 || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0)
-	return;
-    (void) SSL_set_ex_data(ssl, dane_idx, 0);
+static void lru_push(dane_cache_shard *s, dane_cache_entry *e)
+{
+    e->prev = 0;
+    if ((e->next = s->head) != 0)
+	s->head->prev = e;
+    else
+	s->tail = e;
+    s->head = e;
+}
 
-    dane_reset(dane);
-    if (dane->hosts)
-	list_free(dane->hosts, ossl_free);
-    for (u = 0; u <= DANESSL_USAGE_LAST; ++u)
-	if (dane->selectors[u])
-	    list_free(dane->selectors[u], dane_selector_free);
-    if (dane->pkeys)
-	list_free(dane->pkeys, pkey_free);
-    if (dane->certs)
-	list_free(dane->certs, cert_free);
-    OPENSSL_free(dane);
+/*
+ * Remove the entry at "*ep" from its shard, and free it.  Returns the
+ * memory released, which the caller deducts from the cache.
+ */
+static size_t cache_unlink(dane_cache_shard *s, dane_cache_entry **ep)
+{
+    dane_cache_entry *e = *ep;
+    size_t size = e->size;
+
+    *ep = e->chain;
+    lru_unlink(s, e);
+    --s->nentries;
+    DANESSL_POLICY_free(e->policy);
+    OPENSSL_free(e);
+    return size;
 }
 
-static DANE_HOST_LIST host_list_init(const char **src)
+static size_t cache_evict(dane_cache_shard *s, dane_cache_entry *e)
 {
-    DANE_HOST_LIST head = 0;
+    return cache_unlink(s, cache_find(s, e->hash, e->domain,
+				      strlen(e->domain)));
+}
 
-    while (*src) {
-	DANE_HOST_LIST elem = (DANE_HOST_LIST) OPENSSL_malloc(sizeof(*elem));
-	if (elem == 0) {
-	    list_free(head, ossl_free);
-	    return 0;
-	}
-	elem->value = OPENSSL_strdup(*src++);
-	LINSERT(head, elem);
+/*
+ * Evict the least recently used entry of a write-locked shard, other than
+ * "keep", returning the memory released.  Entries flagged by lookups since
+ * they were queued are requeued unflagged instead.
+ */
+static size_t cache_evict_lru(dane_cache_shard *s, dane_cache_entry *keep)
+{
+    dane_cache_entry *e;
+
+    while ((e = s->tail) != 0 && e != keep) {
+	if (!dane_atomic_get(&e->used))
+	    return cache_evict(s, e);
+	dane_atomic_set(&e->used, 0);
+	lru_unlink(s, e);
+	lru_push(s, e);
     }
-    return head;
+    return 0;
 }
 
+/*
+ * Add "added" and deduct "freed" bytes of memory use, returning by how much
+ * the cache is then over budget.  Called with a shard write-locked.
+ */
+static size_t cache_charge(DANESSL_CACHE *cache, size_t added, size_t freed)
+{
+    size_t over;
+
+    bytes_lock(cache);
+    cache->bytes += added;
+    cache->bytes -= freed;
+    over = cache->bytes > cache->budget ? cache->bytes - cache->budget : 0;
+    bytes_unlock(cache);
+    return over;
+}
 
-int DANESSL_get_match_cert(SSL *ssl, X509 **match, const char **mhost, int *depth)
+/*
+ * Evict entries of a write-locked shard, other than "keep", until the cache
+ * is no longer "over" budget, or the shard has none left to evict.
+ */
+static size_t cache_trim(DANESSL_CACHE *cache, dane_cache_shard *s,
+			 dane_cache_entry *keep, size_t over)
 {
-    DANESSL *dane;
+    size_t size;
 
-    if (dane_idx < 0 || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0) {
-	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_INIT);
-	return -1;
-    }
+    while (over > 0 && (size = cache_evict_lru(s, keep)) > 0)
+	over = cache_charge(cache, 0, size);
+    return over;
+}
 
-    if (dane->match) {
-	if (match)
-	    *match = dane->match;
-	if (mhost)
-	    *mhost = dane->mhost;
-	if (depth)
-	    *depth = dane->mdpth;
+/*
+ * Double the size of the hash table of a shard, failure just leaves the
+ * chains longer.
+ */
+static void cache_rehash(dane_cache_shard *s)
+{
+    size_t n = 2 * s->nbuckets;
+    dane_cache_entry **old = s->buckets;
+    size_t oldn = s->nbuckets;
+    dane_cache_entry **tmp;
+    dane_cache_entry *e;
+    size_t i;
+
+    if (n > SIZE_MAX / sizeof(*tmp)
+	|| (tmp = OPENSSL_malloc(n * sizeof(*tmp))) == 0)
+	return;
+    memset(tmp, 0, n * sizeof(*tmp));
+    s->buckets = tmp;
+    s->nbuckets = n;
+    for (i = 0; i < oldn; ++i) {
+	while ((e = old[i]) != 0) {
+	    dane_cache_entry **ep = cache_bucket(s, e->hash);
+
+	    old[i] = e->chain;
+	    e->chain = *ep;
+	    *ep = e;
+	}
     }
-
-    return (dane->match != 0);
+    OPENSSL_free(old);
 }
 
-int DANESSL_verify_chain(SSL *ssl, STACK_OF(X509) *chain)
+DANESSL_CACHE *DANESSL_CACHE_new(size_t budget)
 {
-    int ret;
-    X509 *cert;
-    X509_STORE_CTX *store_ctx;
-    SSL_CTX *ssl_ctx = SSL_get_SSL_CTX(ssl);
-    X509_STORE *store = SSL_CTX_get_cert_store(ssl_ctx);
-    int store_ctx_idx = SSL_get_ex_data_X509_STORE_CTX_idx();
+    DANESSL_CACHE *cache;
+    int i;
 
-    cert = sk_X509_value(chain, 0);
-    if ((store_ctx = X509_STORE_CTX_new()) == NULL) {
-	DANEerr(DANESSL_F_DANESSL_VERIFY_CHAIN, ERR_R_MALLOC_FAILURE);
+    if (!dane_ready_get()) {
+	DANEerr(DANESSL_F_CACHE_NEW, DANESSL_R_LIBRARY_INIT);
 	return 0;
     }
-    if (!X509_STORE_CTX_init(store_ctx, store, cert, chain)) {
-	X509_STORE_CTX_free(store_ctx);
+    if ((cache = OPENSSL_malloc(sizeof(*cache))) == 0) {
+	DANEerr(DANESSL_F_CACHE_NEW, ERR_R_MALLOC_FAILURE);
 	return 0;
     }
-    X509_STORE_CTX_set_ex_data(store_ctx, store_ctx_idx, ssl);
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget;
 
-    X509_STORE_CTX_set_default(store_ctx,
-	    SSL_is_server(ssl) ? "ssl_client" : "ssl_server");
-    X509_VERIFY_PARAM_set1(X509_STORE_CTX_get0_param(store_ctx),
-	    SSL_get0_param(ssl));
+    for (i = 0; i < DANE_CACHE_SHARDS; ++i) {
+	dane_cache_shard *s = &cache->shards[i];
+	size_t n = DANE_CACHE_BUCKETS * sizeof(*s->buckets);
 
-    if (SSL_get_verify_callback(ssl))
-	X509_STORE_CTX_set_verify_cb(store_ctx, SSL_get_verify_callback(ssl));
+	if (!cache_lock_new(&s->lock) || (s->buckets = OPENSSL_malloc(n)) == 0)
+	    break;
+	memset(s->buckets, 0, n);
+	s->nbuckets = DANE_CACHE_BUCKETS;
+    }
+    if (i < DANE_CACHE_SHARDS || !cache_lock_new(&cache->lock)) {
+	DANEerr(DANESSL_F_CACHE_NEW, ERR_R_MALLOC_FAILURE);
+	DANESSL_CACHE_free(cache);
+	return 0;
+    }
+    return cache;
+}
 
-    ret = verify_cert(store_ctx, NULL);
+void DANESSL_CACHE_free(DANESSL_CACHE *cache)
+{
+    int i;
 
-    SSL_set_verify_result(ssl, X509_STORE_CTX_get_error(store_ctx));
-    X509_STORE_CTX_free(store_ctx);
+    if (cache == 0)
+	return;
 
-    return (ret);
-}
+    for (i = 0; i < DANE_CACHE_SHARDS; ++i) {
+	dane_cache_shard *s = &cache->shards[i];
 
+	while (s->tail)
+	    cache_evict(s, s->tail);
+	if (s->buckets)
+	    OPENSSL_free(s->buckets);
+	cache_lock_free(&s->lock);
+    }
+    cache_lock_free(&cache->lock);
+    OPENSSL_free(cache);
+}
 
-int DANESSL_add_tlsa(
-	SSL *ssl,
-	uint8_t usage,
-	uint8_t selector,
-	const char *mdname,
-	unsigned const char *data,
-	size_t dlen
+int DANESSL_CACHE_add(
+	DANESSL_CACHE *cache,
+	const char *domain,
+	DANESSL_POLICY *pol,
+	unsigned long ttl
 )
 {
-    DANESSL *dane;
-    DANE_SELECTOR_LIST s = 0;
-    DANE_MTYPE_LIST m = 0;
-    DANE_DATA_LIST d = 0;
-    DANE_CERT_LIST xlist = 0;
-    DANE_PKEY_LIST klist = 0;
-    const EVP_MD *md = 0;
-
-    if (dane_idx < 0 || (dane = SSL_get_ex_data(ssl, dane_idx)) == 0) {
-	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_INIT);
-	return -1;
-    }
-
-    if (usage > DANESSL_USAGE_LAST) {
-	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_USAGE);
-	return 0;
-    }
-    if (selector > DANESSL_SELECTOR_LAST) {
-	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_SELECTOR);
+    dane_cache_shard *s;
+    dane_cache_entry *e;
+    dane_cache_entry **ep;
+    uint32_t hash;
+    size_t len = domain_hash(domain, &hash);
+    size_t freed = 0;
+    size_t over;
+    size_t i;
+
+    if (ttl == 0 || len == 0)
 	return 0;
+    if ((e = OPENSSL_malloc(sizeof(*e) + len)) == 0) {
+	DANEerr(DANESSL_F_CACHE_ADD, ERR_R_MALLOC_FAILURE);
+	return -1;
     }
+    for (i = 0; i < len; ++i) {
+	char c = domain[i];
 
-    /* Support built-in standard one-digit mtypes */
-    if (mdname && *mdname && mdname[1] == '\0') 
-	switch (*mdname - '0') {
-	    case DANESSL_MATCHING_FULL: mdname = 0;	   break;
-	    case DANESSL_MATCHING_2256: mdname = "sha256"; break;
-	    case DANESSL_MATCHING_2512: mdname = "sha512"; break;
-	}
-    if (mdname && *mdname && (md = EVP_get_digestbyname(mdname)) == 0) {
-	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_DIGEST);
-	return 0;
+	e->domain[i] = (c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c;
     }
-    if (mdname && *mdname && dlen != EVP_MD_size(md)) {
-	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_DATA_LENGTH);
+    e->domain[len] = '\0';
+    e->hash = hash;
+    e->expires = time(0) + (time_t) ttl;
+    e->prev = e->next = e->chain = 0;
+    dane_atomic_set(&e->used, 0);
+
+    /* Not yet shared, so the policy can still be compacted. */
+    if (!dane_atomic_get(&pol->frozen))
+	policy_compact(pol);
+    e->size = sizeof(*e) + len + policy_size(pol);
+
+    /* An entry larger than the whole budget would just flush the cache. */
+    if (e->size > cache->budget || !DANESSL_POLICY_up_ref(pol)) {
+	OPENSSL_free(e);
 	return 0;
     }
-    if (!data) {
-	DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_NULL_DATA);
-	return 0;
-    }
-
-    /*
-     * Full Certificate or Public Key when NULL or empty digest name
-     */
-    if (!mdname || !*mdname) {
-	X509 *x = 0;
-	EVP_PKEY *k = 0;
-	const unsigned char *p = data;
-
-#define xklistinit(lvar, ltype, var, freeFunc) do { \
-	    (lvar) = (ltype) OPENSSL_malloc(sizeof(*(lvar))); \
-	    if ((lvar) == 0) { \
-		DANEerr(DANESSL_F_ADD_TLSA, ERR_R_MALLOC_FAILURE); \
-		freeFunc((var)); \
-		return 0; \
-	    } \
-	    (lvar)->next = 0; \
-	    lvar->value = var; \
-	} while (0)
-#define xkfreeret(ret) do { \
-	    if (xlist) list_free(xlist, cert_free); \
-	    if (klist) list_free(klist, pkey_free); \
-	    return (ret); \
-	} while (0)
-
-	switch (selector) {
-	case DANESSL_SELECTOR_CERT:
-	    if (!d2i_X509(&x, &p, dlen) || dlen != p - data) {
-		if (x)
-		    X509_free(x);
-		DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_CERT);
-		return 0;
-	    }
-	    k = X509_get_pubkey(x);
-	    EVP_PKEY_free(k);
-	    if (k == 0) {
-		X509_free(x);
-		DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_CERT_PKEY);
-		return 0;
-	    }
-	    if (usage == DANESSL_USAGE_DANE_TA)
-		xklistinit(xlist, DANE_CERT_LIST, x, X509_free);
-	    break;
-
-	case DANESSL_SELECTOR_SPKI:
-	    if (!d2i_PUBKEY(&k, &p, dlen) || dlen != p - data) {
-		if (k)
-		    EVP_PKEY_free(k);
-		DANEerr(DANESSL_F_ADD_TLSA, DANESSL_R_BAD_PKEY);
-		return 0;
-	    }
-	    if (usage == DANESSL_USAGE_DANE_TA)
-		xklistinit(klist, DANE_PKEY_LIST, k, EVP_PKEY_free);
-	    break;
-	}
-    }
-
-    /* Find insertion point and don't add duplicate elements. */
-    for (s = dane->selectors[usage]; s; s = s->next) {
-	if (s->value->selector == selector) {
-	    for (m = s->value->mtype; m; m = m->next) {
-		if (m->value->md == md) {
-		    for (d = m->value->data; d; d = d->next)
-			if (d->value->datalen == dlen &&
-			    memcmp(d->value->data, data, dlen) == 0)
-			    xkfreeret(1);
-		    break;
-		}
-	    }
-	    break;
-	}
+    dane_atomic_set(&pol->frozen, 1);
+    e->policy = pol;
+
+    s = &cache->shards[hash & (DANE_CACHE_SHARDS - 1)];
+    shard_wlock(s);
+    if (*(ep = cache_find(s, hash, e->domain, len)) != 0)
+	freed = cache_unlink(s, ep);
+    if (s->nentries >= s->nbuckets)
+	cache_rehash(s);
+
+    ep = cache_bucket(s, hash);
+    e->chain = *ep;
+    *ep = e;
+    lru_push(s, e);
+    ++s->nentries;
+    over = cache_trim(cache, s, e, cache_charge(cache, e->size, freed));
+    shard_wunlock(s);
+
+    for (i = 1; over > 0 && i < DANE_CACHE_SHARDS; ++i) {
+	s = &cache->shards[(hash + i) & (DANE_CACHE_SHARDS - 1)];
+	shard_wlock(s);
+	over = cache_trim(cache, s, 0, cache_charge(cache, 0, 0));
+	shard_wunlock(s);
     }
+    return 1;
+}
 
-    if ((d = (DANE_DATA_LIST) list_alloc(sizeof(*d->value) + dlen)) == 0)
-	xkfreeret(0);
-    d->value->datalen = dlen;
-    memcpy(d->value->data, data, dlen);
-    if (!m) {
-	if ((m = (DANE_MTYPE_LIST) list_alloc(sizeof(*m->value))) == 0) {
-	    list_free(d, ossl_free);
-	    xkfreeret(0);
-	}
-	m->value->data = 0;
-	if ((m->value->md = md) != 0)
-	    m->value->mdlen = dlen;
-	if (!s) {
-	    if ((s = (DANE_SELECTOR_LIST) list_alloc(sizeof(*s->value))) == 0) {
-		list_free(m, dane_mtype_free);
-		xkfreeret(0);
-	    }
-	    s->value->mtype = 0;
-	    s->value->selector = selector;
-	    LINSERT(dane->selectors[usage], s);
-	}
-	LINSERT(s->value->mtype, m);
+DANESSL_POLICY *DANESSL_CACHE_get(DANESSL_CACHE *cache, const char *domain)
+{
+    dane_cache_shard *s;
+    dane_cache_entry *e;
+    DANESSL_POLICY *pol = 0;
+    uint32_t hash;
+    size_t len = domain_hash(domain, &hash);
+
+    s = &cache->shards[hash & (DANE_CACHE_SHARDS - 1)];
+    shard_rlock(s);
+    if ((e = *cache_find(s, hash, domain, len)) != 0
+	&& e->expires > time(0) && DANESSL_POLICY_up_ref(e->policy)) {
+	pol = e->policy;
+	if (!dane_atomic_get(&e->used))
+	    dane_atomic_set(&e->used, 1);
     }
-    LINSERT(m->value->data, d);
+    shard_runlock(s);
+    return pol;
+}
 
-    if (xlist)
-	LINSERT(dane->certs, xlist);
-    else if (klist)
-	LINSERT(dane->pkeys, klist);
-    ++dane->count;
-    return 1;
+void DANESSL_CACHE_remove(DANESSL_CACHE *cache, const char *domain)
+{
+    dane_cache_shard *s;
+    dane_cache_entry **ep;
+    uint32_t hash;
+    size_t len = domain_hash(domain, &hash);
+
+    s = &cache->shards[hash & (DANE_CACHE_SHARDS - 1)];
+    shard_wlock(s);
+    if (*(ep = cache_find(s, hash, domain, len)) != 0)
+	cache_charge(cache, 0, cache_unlink(s, ep));
+    shard_wunlock(s);
 }
 
 int DANESSL_init(SSL *ssl, const char *sni_domain, const char **hostnames)
@@ -1346,7 +4872,7 @@ int DANESSL_init(SSL *ssl, const char *sni_domain, const char **hostnames)
     DANESSL *dane;
     int i;
 
-    if (dane_idx < 0) {
+    if (!dane_ready_get()) {
 	DANEerr(DANESSL_F_INIT, DANESSL_R_LIBRARY_INIT);
 	return -1;
     }
@@ -1354,44 +4880,73 @@ int DANESSL_init(SSL *ssl, const char *sni_domain, const char **hostnames)
     if (sni_domain && !SSL_set_tlsext_host_name(ssl, sni_domain))
 	return 0;
 
-    if ((dane = (DANESSL *) OPENSSL_malloc(sizeof(DANESSL))) == 0) {
-	DANEerr(DANESSL_F_INIT, ERR_R_MALLOC_FAILURE);
-	return 0;
-    }
-    if (!SSL_set_ex_data(ssl, dane_idx, dane)) {
-	DANEerr(DANESSL_F_INIT, ERR_R_MALLOC_FAILURE);
-	OPENSSL_free(dane);
-	return 0;
+    if ((dane = pool_get()) == 0) {
+	if ((dane = (DANESSL *) OPENSSL_malloc(sizeof(DANESSL))) == 0) {
+	    DANEerr(DANESSL_F_INIT, ERR_R_MALLOC_FAILURE);
+	    return 0;
+	}
+	dane->chain = 0;
+	dane->roots = 0;
+	dane->match = 0;
+	dane->memo = 0;
+	dane->nmemo = 0;
+	dane->mmemo = 0;
+	dane->der = 0;
+	dane->derlen = 0;
+	dane->dermax = 0;
+	dane->issuers = 0;
+	dane->missuers = 0;
+	for (i = 0; i < DANE_MAX_MDS; ++i)
+	    dane->mdctx[i] = 0;
+	dane->arena.head = 0;
+	dane->policy = &no_policy;
     }
-
-    dane->pkeys = 0;
-    dane->certs = 0;
-    dane->chain = 0;
-    dane->match = 0;
-    dane->roots = 0;
+    dane->next = 0;
     dane->depth = -1;
     dane->mhost = 0;			/* Future SSL control interface */
     dane->mdpth = 0;			/* Future SSL control interface */
     dane->multi = 0;			/* Future SSL control interface */
-    dane->count = 0;
-    dane->hosts = 0;
+    memset(&dane->names, 0, sizeof(dane->names));
+    dane->native = 0;
+    dane->fixed = 0;
+    dane->loaded = 0;
+    dane->nloaded = 0;
+    dane->verdicts = 0;
+    arena_mark(&dane->arena, &dane->mark);
 
-    for (i = 0; i <= DANESSL_USAGE_LAST; ++i)
-	dane->selectors[i] = 0;
+    if (!SSL_set_ex_data(ssl, dane_idx, dane)) {
+	DANEerr(DANESSL_F_INIT, ERR_R_MALLOC_FAILURE);
+	dane_free(dane);
+	return 0;
+    }
 
-    if (hostnames && (dane->hosts = host_list_init(hostnames)) == 0) {
+    if (hostnames && !names_init(&dane->arena, &dane->names, hostnames)) {
 	DANEerr(DANESSL_F_INIT, ERR_R_MALLOC_FAILURE);
 	DANESSL_cleanup(ssl);
 	return 0;
     }
+    arena_mark(&dane->arena, &dane->mark);
 
+    if ((dane->native = native_init(ssl, sni_domain, hostnames)) < 0) {
+	DANEerr(DANESSL_F_INIT, ERR_R_MALLOC_FAILURE);
+	DANESSL_cleanup(ssl);
+	return 0;
+    }
     return 1;
 }
 
 int DANESSL_CTX_init(SSL_CTX *ctx)
 {
-    if (dane_idx >= 0) {
+    if (dane_ready_get()) {
 	SSL_CTX_set_cert_verify_callback(ctx, verify_cert, 0);
+#if DANE_NATIVE
+	/* Without it connections just use the compatibility backend */
+	if (native_ok()) {
+	    ERR_set_mark();
+	    (void) SSL_CTX_dane_enable(ctx);
+	    ERR_pop_to_mark();
+	}
+#endif
 	return 1;
     }
     DANEerr(DANESSL_F_CTX_INIT, DANESSL_R_LIBRARY_INIT);
@@ -1428,6 +4983,9 @@ static void dane_init(void)
     if (!EVP_get_digestbyname(LN_sha512))
 	EVP_add_digest(EVP_sha512());
 #endif
+    mtype_md[DANESSL_MATCHING_FULL] = 0;
+    mtype_md[DANESSL_MATCHING_2256] = EVP_get_digestbyname(LN_sha256);
+    mtype_md[DANESSL_MATCHING_2512] = EVP_get_digestbyname(LN_sha512);
 
     /*
      * Register an SSL index for the connection-specific DANESSL structure.
@@ -1436,27 +4994,34 @@ static void dane_init(void)
      * SSL structure.
      */
     dane_idx = SSL_get_ex_new_index(0, 0, 0, 0, 0);
+    ssl_store_idx = SSL_get_ex_data_X509_STORE_CTX_idx();
+    server_auth = OBJ_nid2obj(NID_server_auth);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    pool_ok = CRYPTO_THREAD_init_local(&pool_key, pool_free);
+    wrap_rwlock = CRYPTO_THREAD_lock_new();
+#endif
+
+    if (dane_idx >= 0 && ssl_store_idx >= 0 && server_auth != 0
+	&& mtype_md[DANESSL_MATCHING_2256] != 0)
+	dane_ready_set();
 }
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-static void run_once(volatile int *once, void (*init)(void))
+/*
+ * Once the library is ready no lock is taken, the global lock serializes
+ * just the first callers.
+ */
+static void run_once(CRYPTO_ONCE *once, void (*init)(void))
 {
-    int wlock = 0;
-
-    CRYPTO_r_lock(CRYPTO_LOCK_SSL_CTX);
+    if (dane_ready_get())
+	return;
+    CRYPTO_w_lock(CRYPTO_LOCK_SSL_CTX);
     if (!*once) {
-	CRYPTO_r_unlock(CRYPTO_LOCK_SSL_CTX);
-	CRYPTO_w_lock(CRYPTO_LOCK_SSL_CTX);
-	wlock = 1;
-	if (!*once) {
-	    *once = 1;
-	    init();
-	}
+	*once = 1;
+	init();
     }
-    if (wlock)
-	CRYPTO_w_unlock(CRYPTO_LOCK_SSL_CTX);
-    else
-	CRYPTO_r_unlock(CRYPTO_LOCK_SSL_CTX);
+    CRYPTO_w_unlock(CRYPTO_LOCK_SSL_CTX);
 }
 #endif
 
@@ -1466,11 +5031,9 @@ int DANESSL_library_init(void)
 
     (void) CRYPTO_THREAD_run_once(&once, dane_init);
 
-#if defined(LN_sha256)
     /* No DANE without SHA256 support */
-    if (dane_idx >= 0 && EVP_get_digestbyname(LN_sha256) != 0)
+    if (dane_ready_get())
 	return 1;
-#endif
     DANEerr(DANESSL_F_LIBRARY_INIT, DANESSL_R_SUPPORT);
     return 0;
 }
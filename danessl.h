@@ -35,13 +35,189 @@
 #define DANESSL_MATCHING_2512		2
 #define DANESSL_MATCHING_LAST		DANESSL_MATCHING_2512
 
+/*-
+ * A TLSA record, for loading a whole RRset at once.  Unlike the digest
+ * name argument of DANESSL_add_tlsa(), the matching type is given by its
+ * numeric value.
+ */
+typedef struct DANESSL_TLSA {
+    uint8_t usage;
+    uint8_t selector;
+    uint8_t mtype;
+    const unsigned char *data;
+    size_t dlen;
+} DANESSL_TLSA;
+
+/*-
+ * Verification backends, see DANESSL_set_backend().
+ */
+#define DANESSL_BACKEND_AUTO	0	/* Native when available */
+#define DANESSL_BACKEND_COMPAT	1	/* Always this library's own code */
+#define DANESSL_BACKEND_NATIVE	2	/* OpenSSL 1.1.0 or later DANE */
+
 extern int DANESSL_library_init(void);
+/*-
+ * Select how subsequently initialized connections are verified.  The native
+ * backend uses OpenSSL's built-in DANE support, and requires OpenSSL 1.1.0
+ * or later.  Connections without reference names, or with TLSA records
+ * OpenSSL can't use, are always verified by the compatibility backend.
+ * Returns 1 on success, 0 if the backend is not available.
+ */
+extern int DANESSL_set_backend(int);
 extern int DANESSL_CTX_init(SSL_CTX *);
 extern int DANESSL_init(SSL *, const char *, const char **);
 extern void DANESSL_cleanup(SSL *);
+/*-
+ * Handles released by DANESSL_cleanup() are recycled by later calls to
+ * DANESSL_init() in the same thread.  They are freed when the thread exits,
+ * or earlier by calling DANESSL_thread_stop() in the thread.
+ */
+extern void DANESSL_thread_stop(void);
 extern int DANESSL_add_tlsa(SSL *, uint8_t, uint8_t, const char *,
 			    unsigned const char *, size_t);
+/*-
+ * Add all the records of a TLSA RRset.  Unusable records are skipped, the
+ * return value is the number of records added, or -1 on error.
+ */
+extern int DANESSL_add_tlsa_rrset(SSL *, const DANESSL_TLSA *, size_t);
+
+/*-
+ * Add TLSA records given as "n" DNS wire-format RDATA buffers, as returned
+ * by most resolver libraries.  With DANESSL_RDATA_NOCOPY, the association
+ * data is not copied, and the buffers must outlive the DANESSL state.
+ * Returns the number of records added, or -1 on error.
+ */
+#define DANESSL_RDATA_NOCOPY	0x01
+extern int DANESSL_add_tlsa_rdata(SSL *, const unsigned char *const *,
+				  const size_t *, size_t, int);
+
+/*-
+ * A TLSA policy holds a compiled TLSA RRset that can be shared by many
+ * connections.  Records are added with the DANESSL_POLICY_add_*() functions,
+ * which mirror those above.  DANESSL_set_policy() attaches the policy to a
+ * connection initialized with DANESSL_init(), after which it is immutable,
+ * and further additions to it fail.  Each connection holds a reference, so
+ * the caller may free its own once done attaching.  A connection with a
+ * policy attached cannot also have records added directly, nor can a policy
+ * replace records already added directly.  Once a connection has verified
+ * a chain, its records are fixed until the next DANESSL_init(), and both
+ * fail.
+ */
+typedef struct DANESSL_POLICY DANESSL_POLICY;
+
+extern DANESSL_POLICY *DANESSL_POLICY_new(void);
+extern int DANESSL_POLICY_up_ref(DANESSL_POLICY *);
+extern void DANESSL_POLICY_free(DANESSL_POLICY *);
+extern int DANESSL_POLICY_add_tlsa(DANESSL_POLICY *, uint8_t, uint8_t,
+				   const char *, unsigned const char *, size_t);
+extern int DANESSL_POLICY_add_tlsa_rrset(DANESSL_POLICY *,
+					 const DANESSL_TLSA *, size_t);
+extern int DANESSL_POLICY_add_tlsa_rdata(DANESSL_POLICY *,
+					 const unsigned char *const *,
+					 const size_t *, size_t, int);
+extern int DANESSL_set_policy(SSL *, DANESSL_POLICY *);
+
+/*-
+ * A thread-safe cache of policies keyed by TLSA base domain, for reuse
+ * across connections.  DANESSL_CACHE_add() caches a policy, making it
+ * immutable, for "ttl" seconds, normally the TTL of the TLSA RRset.  Least
+ * recently used entries are evicted to keep the total size of the cached
+ * policies within the memory budget given to DANESSL_CACHE_new(), a policy
+ * whose size alone exceeds the budget is not cached.  DANESSL_CACHE_add()
+ * returns 1 when the policy is cached, 0 when it is not, and -1 on error.
+ * DANESSL_CACHE_get() returns a new reference to the cached policy, to be
+ * passed to DANESSL_set_policy() and then freed, or NULL when none is
+ * cached or it has expired.  Domain names are compared case-insensitively.
+ */
+typedef struct DANESSL_CACHE DANESSL_CACHE;
+
+extern DANESSL_CACHE *DANESSL_CACHE_new(size_t);
+extern void DANESSL_CACHE_free(DANESSL_CACHE *);
+extern int DANESSL_CACHE_add(DANESSL_CACHE *, const char *, DANESSL_POLICY *,
+			     unsigned long);
+extern DANESSL_POLICY *DANESSL_CACHE_get(DANESSL_CACHE *, const char *);
+extern void DANESSL_CACHE_remove(DANESSL_CACHE *, const char *);
+
+/*-
+ * An optional cache of successful verification results, for repeated
+ * connections to the same server.  A result is reused only for the same
+ * peer chain, TLSA records, reference names, trust store, verification
+ * parameters, client or server role and security level, and within the
+ * same "ttl" second time bucket, restoring the verified chain and the
+ * values returned by DANESSL_get_match_cert() without repeating any checks.
+ * The cache holds at most "size" results, and is attached to a connection
+ * initialized with DANESSL_init() by DANESSL_set_verdicts().  It must
+ * outlive those connections.  Changes to the trust store are not detected,
+ * and call for a new cache, as do explicit purpose or trust settings that
+ * differ between connections of the same role.
+ */
+typedef struct DANESSL_VERDICTS DANESSL_VERDICTS;
+
+extern DANESSL_VERDICTS *DANESSL_VERDICTS_new(size_t, unsigned long);
+extern void DANESSL_VERDICTS_free(DANESSL_VERDICTS *);
+extern int DANESSL_set_verdicts(SSL *, DANESSL_VERDICTS *);
+
 extern int DANESSL_get_match_cert(SSL *, X509 **, const char **, int *);
 extern int DANESSL_verify_chain(SSL *, STACK_OF(X509) *);
 
+/*-
+ * Asynchronous verification, for event-driven applications.  A pool of
+ * worker threads, one per CPU when "nthreads" is 0, runs
+ * DANESSL_verify_chain() off the caller's thread.  The connection must not
+ * be used until its job completes, the chain may be freed at once.  If a
+ * callback is given, it is called from the worker thread with the
+ * connection, the result of DANESSL_verify_chain() and "arg".  Otherwise
+ * the connection is queued, and the descriptor of DANESSL_WORKERS_fd() is
+ * readable while any are; DANESSL_WORKERS_done() returns the next one and
+ * its result, or NULL, without blocking.  The verify result, and
+ * DANESSL_get_match_cert(), then report the outcome as usual.
+ * DANESSL_WORKERS_free() waits for pending jobs, and discards completed
+ * ones not yet collected.  Requires POSIX threads.
+ */
+typedef struct DANESSL_WORKERS DANESSL_WORKERS;
+
+extern DANESSL_WORKERS *DANESSL_WORKERS_new(int);
+extern void DANESSL_WORKERS_free(DANESSL_WORKERS *);
+extern int DANESSL_WORKERS_fd(DANESSL_WORKERS *);
+extern SSL *DANESSL_WORKERS_done(DANESSL_WORKERS *, int *);
+extern int DANESSL_verify_chain_async(DANESSL_WORKERS *, SSL *,
+				      STACK_OF(X509) *,
+				      void (*)(SSL *, int, void *), void *);
+
+/*-
+ * Batch verification, for re-verifying many saved chains at once.  Each job
+ * gives a peer chain, leaf first, the SNI domain and reference names as for
+ * DANESSL_init(), and either a policy, or else a TLSA RRset as for
+ * DANESSL_add_tlsa_rrset().  Chains and policies may be shared between
+ * jobs.  Each job is verified with a connection of "ctx", which must have
+ * been initialized with DANESSL_CTX_init(), and with the verdict cache, if
+ * not NULL.  Connections are reused between the jobs of a thread, except
+ * after jobs verified by OpenSSL's own DANE support, see
+ * DANESSL_set_backend().  The "n" jobs are shared out among "nthreads"
+ * threads, one per CPU when 0, including the caller's, and on return
+ * results[i] holds the outcome of jobs[i]: the return value of
+ * DANESSL_verify_chain(), or -1 if the job could not be set up, the verify
+ * result, and the depth of the matched certificate, or -1.  Returns 1 on
+ * success, or -1 if the library is not initialized.  Without POSIX
+ * threads, the jobs are all verified in the caller's thread.
+ */
+typedef struct DANESSL_JOB {
+    STACK_OF(X509) *chain;
+    DANESSL_POLICY *policy;
+    const DANESSL_TLSA *rrset;
+    size_t nrrs;
+    const char *sni_domain;
+    const char **hostnames;
+} DANESSL_JOB;
+
+typedef struct DANESSL_RESULT {
+    int ret;
+    long verify_result;
+    int depth;
+} DANESSL_RESULT;
+
+extern int DANESSL_verify_batch(SSL_CTX *, DANESSL_VERDICTS *,
+				const DANESSL_JOB *, DANESSL_RESULT *,
+				size_t, int);
+
 #endif
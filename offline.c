@@ -7,6 +7,7 @@
 #include <stdlib.h>
 
 #include <unistd.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <string.h>
 
@@ -29,7 +30,11 @@ static void print_errors(void)
     int line;
     int flags;
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    while ((err = ERR_get_error_all(&file, &line, 0, &data, &flags)) != 0) {
+#else
     while ((err = ERR_get_error_line_data(&file, &line, &data, &flags)) != 0) {
+#endif
 	ERR_error_string_n(err, buffer, sizeof(buffer));
 	if (flags & ERR_TXT_STRING)
 	    fprintf(stderr, "Error: %s:%s:%d:%s\n", buffer, file, line, data);
@@ -48,24 +53,241 @@ static void fatal(const char *fmt, ...)
     va_end(ap);
 
     print_errors();
-    exit(1);
+    exit(2);
 }
 
-static int add_tlsa(SSL *ssl, const char *argv[])
+/* How TLSA records are loaded, from the DANESSL_LOAD environment variable */
+static const char *load;
+
+/* A second connection sharing the records, which must verify alike */
+static SSL *ssl2;
+
+/* How chains are verified, from the DANESSL_VERIFY environment variable */
+static const char *how;
+
+/* Shared by both connections, so that the second reuses the first result */
+static DANESSL_VERDICTS *verdicts;
+
+static uint8_t mtype(const char *mdname)
+{
+    if (mdname == 0)
+	return DANESSL_MATCHING_FULL;
+    if (strcmp(mdname, "sha256") == 0)
+	return DANESSL_MATCHING_2256;
+    if (strcmp(mdname, "sha512") == 0)
+	return DANESSL_MATCHING_2512;
+    fatal("no matching type for digest: %s\n", mdname);
+    return 0;
+}
+
+static void set_tlsa(DANESSL_TLSA *rr, uint8_t u, uint8_t s, uint8_t m,
+		     const unsigned char *data, size_t dlen)
+{
+    rr->usage = u;
+    rr->selector = s;
+    rr->mtype = m;
+    rr->data = data;
+    rr->dlen = dlen;
+}
+
+/*
+ * Add the record as part of an RRset, together with a duplicate, and with
+ * records that must be skipped: one with an unknown usage and one with a
+ * digest of the wrong length.  Only the record itself may be added.
+ */
+static int add_rrset(SSL *ssl, uint8_t u, uint8_t s, uint8_t m,
+		     const unsigned char *data, size_t dlen)
+{
+    DANESSL_TLSA rrset[4];
+    int ret;
+
+    set_tlsa(&rrset[0], DANESSL_USAGE_LAST + 1, s, m, data, dlen);
+    set_tlsa(&rrset[1], u, s, m, data, dlen);
+    set_tlsa(&rrset[2], u, s, DANESSL_MATCHING_2256, data, 31);
+    set_tlsa(&rrset[3], u, s, m, data, dlen);
+    if ((ret = DANESSL_add_tlsa_rrset(ssl, rrset, 4)) != 1)
+	fprintf(stderr, "RRset records added: %d, expected 1\n", ret);
+    return ret == 1;
+}
+
+/*
+ * Wire-format RDATA buffers, which with DANESSL_RDATA_NOCOPY must outlive
+ * the connection.
+ */
+#define NRDATA 5
+static unsigned char *rdata[NRDATA];
+
+static size_t set_rdata(int i, uint8_t u, uint8_t s, uint8_t m,
+			const unsigned char *data, size_t dlen)
+{
+    if ((rdata[i] = malloc(dlen + 3)) == 0) {
+	perror("malloc");
+	exit(1);
+    }
+    rdata[i][0] = u;
+    rdata[i][1] = s;
+    rdata[i][2] = m;
+    memcpy(rdata[i] + 3, data, dlen);
+    return dlen + 3;
+}
+
+/*
+ * As with add_rrset(), but with the RRset as RDATA, which also includes
+ * RDATA too short to hold any association data.
+ */
+static int add_rdata(SSL *ssl, uint8_t u, uint8_t s, uint8_t m,
+		     const unsigned char *data, size_t dlen, int flags)
+{
+    size_t rdlen[NRDATA];
+    int ret;
+
+    rdlen[0] = set_rdata(0, u, s, m, data, 0);
+    rdlen[1] = set_rdata(1, DANESSL_USAGE_LAST + 1, s, m, data, dlen);
+    rdlen[2] = set_rdata(2, u, s, m, data, dlen);
+    rdlen[3] = set_rdata(3, u, s, DANESSL_MATCHING_2256, data, 31);
+    rdlen[4] = set_rdata(4, u, s, m, data, dlen);
+    ret = DANESSL_add_tlsa_rdata(ssl, (const unsigned char *const *) rdata,
+				 rdlen, NRDATA, flags);
+    if (ret != 1)
+	fprintf(stderr, "RDATA records added: %d, expected 1\n", ret);
+    return ret == 1;
+}
+
+static void free_rdata(void)
+{
+    int i;
+
+    for (i = 0; i < NRDATA; ++i)
+	free(rdata[i]);
+}
+
+/*
+ * Add the record to a policy shared with the second connection.  Once
+ * attached, the policy can't be changed, not even via the connections.
+ */
+static int add_policy(SSL *ssl, uint8_t u, uint8_t s, const char *mdname,
+		      const unsigned char *data, size_t dlen)
+{
+    DANESSL_POLICY *pol;
+    int ok;
+
+    if ((pol = DANESSL_POLICY_new()) == 0)
+	return 0;
+    ok = DANESSL_POLICY_add_tlsa(pol, u, s, mdname, data, dlen) > 0
+	&& DANESSL_set_policy(ssl, pol) > 0
+	&& DANESSL_set_policy(ssl2, pol) > 0;
+    if (ok) {
+	ERR_set_mark();
+	if (DANESSL_POLICY_add_tlsa(pol, u, s, mdname, data, dlen) >= 0
+	    || DANESSL_add_tlsa(ssl2, u, s, mdname, data, dlen) >= 0) {
+	    fprintf(stderr, "shared policy not frozen\n");
+	    ok = 0;
+	}
+	ERR_pop_to_mark();
+    }
+    DANESSL_POLICY_free(pol);
+    return ok;
+}
+
+/*
+ * Cache a policy holding the record, and attach it to both connections,
+ * looking it up with other spellings of the domain.  Other domains, and
+ * the domain once removed, must not be found.  The budget, though small,
+ * must hold the policy, which a cache of just 64 bytes must refuse.
+ */
+static int add_cached(SSL *ssl, uint8_t u, uint8_t s, const char *mdname,
+		      const unsigned char *data, size_t dlen)
+{
+    DANESSL_CACHE *cache;
+    DANESSL_POLICY *pol;
+    DANESSL_POLICY *pol2 = 0;
+    int ok;
+
+    if ((cache = DANESSL_CACHE_new(64)) == 0)
+	return 0;
+    if ((pol = DANESSL_POLICY_new()) == 0) {
+	DANESSL_CACHE_free(cache);
+	return 0;
+    }
+    ok = DANESSL_POLICY_add_tlsa(pol, u, s, mdname, data, dlen) > 0;
+    if (ok && DANESSL_CACHE_add(cache, "example.com", pol, 3600) != 0) {
+	fprintf(stderr, "oversized policy cached\n");
+	ok = 0;
+    }
+    DANESSL_CACHE_free(cache);
+    if ((cache = DANESSL_CACHE_new(16 << 10)) == 0) {
+	DANESSL_POLICY_free(pol);
+	return 0;
+    }
+    ok = ok && DANESSL_CACHE_add(cache, "Example.COM", pol, 3600) > 0;
+    DANESSL_POLICY_free(pol);
+    pol = 0;
+    if (ok && ((pol = DANESSL_CACHE_get(cache, "example.com.")) == 0
+	       || (pol2 = DANESSL_CACHE_get(cache, "EXAMPLE.com")) != pol)) {
+	fprintf(stderr, "cached policy not found\n");
+	ok = 0;
+    }
+    ok = ok && DANESSL_set_policy(ssl, pol) > 0
+	&& DANESSL_set_policy(ssl2, pol2) > 0;
+    if (ok) {
+	ERR_set_mark();
+	if (DANESSL_POLICY_add_tlsa(pol, u, s, mdname, data, dlen) >= 0) {
+	    fprintf(stderr, "cached policy not frozen\n");
+	    ok = 0;
+	}
+	ERR_pop_to_mark();
+    }
+    DANESSL_POLICY_free(pol);
+    DANESSL_POLICY_free(pol2);
+    if (ok) {
+	DANESSL_CACHE_remove(cache, "example.COM.");
+	if ((pol = DANESSL_CACHE_get(cache, "example.com")) != 0
+	    || (pol = DANESSL_CACHE_get(cache, "example.net")) != 0) {
+	    fprintf(stderr, "unexpected cached policy\n");
+	    DANESSL_POLICY_free(pol);
+	    ok = 0;
+	}
+    }
+    DANESSL_CACHE_free(cache);
+    return ok;
+}
+
+static int load_tlsa(SSL *ssl, uint8_t u, uint8_t s, const char *mdname,
+		     const unsigned char *data, size_t dlen)
+{
+    if (load == 0)
+	return DANESSL_add_tlsa(ssl, u, s, mdname, data, dlen);
+    if (strcmp(load, "rrset") == 0)
+	return add_rrset(ssl, u, s, mtype(mdname), data, dlen);
+    if (strcmp(load, "rdata") == 0)
+	return add_rdata(ssl, u, s, mtype(mdname), data, dlen, 0);
+    if (strcmp(load, "rdata-nocopy") == 0)
+	return add_rdata(ssl, u, s, mtype(mdname), data, dlen,
+			 DANESSL_RDATA_NOCOPY);
+    if (strcmp(load, "policy") == 0)
+	return add_policy(ssl, u, s, mdname, data, dlen);
+    if (strcmp(load, "cache") == 0)
+	return add_cached(ssl, u, s, mdname, data, dlen);
+    fatal("unsupported TLSA loading method: %s\n", load);
+    return 0;
+}
+
+/*
+ * The association data of the TLSA record given on the command line, to be
+ * freed by the caller.
+ */
+static unsigned char *tlsa_data(const char *argv[], size_t *dlen)
 {
     const EVP_MD *md = 0;
     unsigned char mdbuf[EVP_MAX_MD_SIZE];
     unsigned int mdlen;
-    const unsigned char *tlsa_data;
     X509 *cert = 0;
     BIO *bp;
     unsigned char *buf;
     unsigned char *buf2;
     int len;
-    uint8_t u = atoi(argv[1]);
     uint8_t s = atoi(argv[2]);
     const char *mdname = *argv[3] ? argv[3] : 0;
-    int ret = 0;
 
     if ((bp = BIO_new_file(argv[4], "r")) == NULL) {
 	fprintf(stderr, "error opening %s: %m", argv[4]);
@@ -107,16 +329,62 @@ static int add_tlsa(SSL *ssl, const char *argv[])
 	    return 0;
 	}
 	EVP_Digest(buf, len, mdbuf, &mdlen, md, 0);
-	tlsa_data = mdbuf;
+	OPENSSL_free(buf);
+	if ((buf = (unsigned char *) OPENSSL_malloc(mdlen)) == NULL) {
+	    perror("malloc");
+	    return 0;
+	}
+	memcpy(buf, mdbuf, mdlen);
 	len = mdlen;
-    } else {
-	tlsa_data = buf;
     }
-    ret = DANESSL_add_tlsa(ssl, u, s, mdname, tlsa_data, len);
-    OPENSSL_free(buf);
+    *dlen = len;
+    return buf;
+}
+
+static int add_tlsa(SSL *ssl, const char *argv[])
+{
+    unsigned char *data;
+    size_t dlen;
+    int ret;
+
+    if ((data = tlsa_data(argv, &dlen)) == 0)
+	return 0;
+    ret = load_tlsa(ssl, atoi(argv[1]), atoi(argv[2]),
+		    *argv[3] ? argv[3] : 0, data, dlen);
+    OPENSSL_free(data);
     return ret;
 }
 
+/*
+ * Once a connection has verified a chain its records are fixed, and on any
+ * connection a policy must not replace records added directly.
+ */
+static void check_fixed(SSL *ssl, SSL *fresh, const char *argv[])
+{
+    DANESSL_POLICY *pol;
+    unsigned char *data;
+    size_t dlen;
+    uint8_t u = atoi(argv[1]);
+    uint8_t s = atoi(argv[2]);
+    const char *mdname = *argv[3] ? argv[3] : 0;
+
+    if ((pol = DANESSL_POLICY_new()) == 0)
+	fatal("error allocating TLSA policy\n");
+    if ((data = tlsa_data(argv, &dlen)) == 0)
+	fatal("error adding TLSA RR\n");
+    ERR_set_mark();
+    if (DANESSL_add_tlsa(ssl, u, s, mdname, data, dlen) > 0
+	|| DANESSL_set_policy(ssl, pol) > 0)
+	fatal("records changed after verification\n");
+    if (DANESSL_add_tlsa(fresh, u, s, mdname, data, dlen) <= 0)
+	fatal("error adding TLSA RR\n");
+    if (DANESSL_set_policy(fresh, pol) > 0)
+	fatal("policy replaced direct records\n");
+    ERR_pop_to_mark();
+    OPENSSL_free(data);
+    DANESSL_POLICY_free(pol);
+}
+
 static int verify_callback(int ok, X509_STORE_CTX *ctx)
 {
     char    buf[8192];
@@ -217,6 +485,186 @@ static STACK_OF(X509) *load_chain(const char *chainfile)
     exit(1);
 }
 
+static SSL *new_ssl(SSL_CTX *sctx, const char *argv[])
+{
+    SSL *ssl;
+
+    if ((ssl = SSL_new(sctx)) == 0)
+	fatal("error allocating SSL handle\n");
+    if (DANESSL_init(ssl, argv[7], argv+7) <= 0)
+	fatal("error initializing SSL handle DANE state\n");
+    SSL_set_connect_state(ssl);
+    return ssl;
+}
+
+/*
+ * Describe the outcome of a verification in "buf".
+ */
+static long describe(SSL *ssl, char *buf, size_t len)
+{
+    const char *mhost;
+    int mdepth;
+    long ok;
+    int n;
+
+    ok = SSL_get_verify_result(ssl);
+    n = snprintf(buf, len, "verify status: %ld\n", ok);
+    if (DANESSL_get_match_cert(ssl, 0, &mhost, &mdepth) > 0)
+	snprintf(buf + n, len - n, "match depth: %d host: %s\n", mdepth,
+		 mhost ? mhost : "");
+    return ok;
+}
+
+static long verify(SSL *ssl, STACK_OF(X509) *chain, char *buf, size_t len)
+{
+    DANESSL_verify_chain(ssl, chain);
+    print_errors();
+    return describe(ssl, buf, len);
+}
+
+/*
+ * Verify the chain asynchronously on connections that alternately have the
+ * given TLSA records, and just one that matches nothing.  Jobs are in turn
+ * collected via the workers' descriptor and via a callback.  Those with the
+ * given records must all have the same outcome as "result", the others must
+ * all fail.
+ */
+#define ASYNC_JOBS	8
+
+static void async_done(SSL *ssl, int ret, void *arg)
+{
+    *(int *) arg = ret;
+}
+
+static void verify_async(SSL_CTX *sctx, const char *argv[],
+			 STACK_OF(X509) *chain, const char *result)
+{
+    static const unsigned char nomatch[32];
+    DANESSL_WORKERS *workers;
+    SSL *ssls[ASYNC_JOBS];
+    int rets[ASYNC_JOBS];
+    char buf[1024];
+    int queued = 0;
+    int i;
+
+    if ((workers = DANESSL_WORKERS_new(2)) == 0)
+	fatal("error starting verification workers\n");
+    for (i = 0; i < ASYNC_JOBS; ++i) {
+	int callback = i & 2;
+
+	ssls[i] = new_ssl(sctx, argv);
+	if ((i & 1) ?
+	    DANESSL_add_tlsa(ssls[i], DANESSL_USAGE_DANE_EE,
+			     DANESSL_SELECTOR_SPKI, "sha256", nomatch,
+			     sizeof(nomatch)) <= 0 :
+	    !add_tlsa(ssls[i], argv))
+	    fatal("error adding TLSA RR\n");
+	if (!DANESSL_verify_chain_async(workers, ssls[i], chain,
+					callback ? async_done : 0, &rets[i]))
+	    fatal("error queueing verification job\n");
+	if (!callback)
+	    ++queued;
+    }
+
+    while (queued > 0) {
+	struct pollfd pfd;
+	SSL *ssl;
+	int ret;
+
+	pfd.fd = DANESSL_WORKERS_fd(workers);
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, -1) < 0)
+	    fatal("poll: %m\n");
+	while ((ssl = DANESSL_WORKERS_done(workers, &ret)) != 0) {
+	    for (i = 0; ssls[i] != ssl; ++i)
+		/* NOP */;
+	    rets[i] = ret;
+	    --queued;
+	}
+    }
+    /* Waits for the callbacks */
+    DANESSL_WORKERS_free(workers);
+
+    for (i = 0; i < ASYNC_JOBS; ++i) {
+	long ok = describe(ssls[i], buf, sizeof(buf));
+
+	if ((i & 1) && ok == X509_V_OK)
+	    fatal("async job %d verified without a matching record\n", i);
+	if (!(i & 1) && (strcmp(buf, result) != 0 || rets[i] != rets[0]))
+	    fatal("async job %d differs:\n%s", i, buf);
+	DANESSL_cleanup(ssls[i]);
+	SSL_free(ssls[i]);
+    }
+}
+
+/*
+ * Verify the chain as a batch of jobs that alternately have the given record
+ * as their RRset, and a shared policy whose only record matches nothing,
+ * first with two threads and then in the caller's thread.  Jobs with the
+ * given record must all have the same outcome as "ssl", the others must all
+ * fail.
+ */
+#define BATCH_JOBS	24
+
+static void verify_batch(SSL_CTX *sctx, const char *argv[],
+			 STACK_OF(X509) *chain, SSL *ssl)
+{
+    static const unsigned char nomatch[32];
+    DANESSL_JOB jobs[BATCH_JOBS];
+    DANESSL_RESULT results[BATCH_JOBS];
+    DANESSL_POLICY *pol;
+    DANESSL_TLSA rr;
+    unsigned char *data;
+    size_t dlen;
+    long ok = SSL_get_verify_result(ssl);
+    int depth;
+    int nthreads;
+    int i;
+
+    if (DANESSL_get_match_cert(ssl, 0, 0, &depth) <= 0)
+	depth = -1;
+    if ((data = tlsa_data(argv, &dlen)) == 0)
+	fatal("error adding TLSA RR\n");
+    set_tlsa(&rr, atoi(argv[1]), atoi(argv[2]), mtype(*argv[3] ? argv[3] : 0),
+	     data, dlen);
+    if ((pol = DANESSL_POLICY_new()) == 0
+	|| DANESSL_POLICY_add_tlsa(pol, DANESSL_USAGE_DANE_EE,
+				   DANESSL_SELECTOR_SPKI, "sha256", nomatch,
+				   sizeof(nomatch)) <= 0)
+	fatal("error creating TLSA policy\n");
+
+    memset(jobs, 0, sizeof(jobs));
+    for (i = 0; i < BATCH_JOBS; ++i) {
+	jobs[i].chain = chain;
+	jobs[i].sni_domain = argv[7];
+	jobs[i].hostnames = argv + 7;
+	if (i & 1) {
+	    jobs[i].policy = pol;
+	} else {
+	    jobs[i].rrset = &rr;
+	    jobs[i].nrrs = 1;
+	}
+    }
+
+    for (nthreads = 2; nthreads > 0; --nthreads) {
+	if (DANESSL_verify_batch(sctx, 0, jobs, results, BATCH_JOBS,
+				 nthreads) <= 0)
+	    fatal("error verifying batch\n");
+	for (i = 0; i < BATCH_JOBS; ++i) {
+	    if ((i & 1) && (results[i].verify_result == X509_V_OK
+			    || results[i].depth != -1))
+		fatal("batch job %d verified without a matching record\n", i);
+	    if (!(i & 1) && (results[i].verify_result != ok
+			     || results[i].depth != depth
+			     || results[i].ret != results[0].ret))
+		fatal("batch job %d differs: verify status: %ld depth: %d\n",
+		      i, results[i].verify_result, results[i].depth);
+	}
+    }
+    DANESSL_POLICY_free(pol);
+    OPENSSL_free(data);
+}
+
 static void usage(const char *progname)
 {
     fprintf(stderr, "Usage: %s certificate-usage selector matching-type"
@@ -236,8 +684,13 @@ static void usage(const char *progname)
 int main(int argc, const char *argv[])
 {
     STACK_OF(X509) *chain;
+    STACK_OF(X509) *chain2 = 0;
     SSL_CTX *sctx;
     SSL *ssl;
+    SSL *fresh;
+    const char *backend;
+    char result[1024];
+    char result2[1024];
     long ok;
 
     if (argc < 8)
@@ -251,6 +704,17 @@ int main(int argc, const char *argv[])
 
     if (DANESSL_library_init() <= 0)
 	fatal("error initializing DANE library\n");
+    if ((backend = getenv("DANESSL_BACKEND")) != 0
+	&& DANESSL_set_backend(strcmp(backend, "native") == 0 ?
+			       DANESSL_BACKEND_NATIVE :
+			       strcmp(backend, "compat") == 0 ?
+			       DANESSL_BACKEND_COMPAT :
+			       DANESSL_BACKEND_AUTO) <= 0)
+	fatal("unsupported DANE backend: %s\n", backend);
+    load = getenv("DANESSL_LOAD");
+    if ((how = getenv("DANESSL_VERIFY")) != 0 && strcmp(how, "verdicts") != 0
+	&& strcmp(how, "async") != 0 && strcmp(how, "batch") != 0)
+	fatal("unsupported verification method: %s\n", how);
 
     /* Initialize context for DANE connections */
     if ((sctx = SSL_CTX_new(SSLv23_client_method())) == 0)
@@ -261,25 +725,84 @@ int main(int argc, const char *argv[])
     if (DANESSL_CTX_init(sctx) <= 0)
 	fatal("error initializing SSL_CTX DANE state\n");
 
-    /* Create a connection handle */
-    if ((ssl = SSL_new(sctx)) == 0)
-	fatal("error allocating SSL handle\n");
-    if (DANESSL_init(ssl, argv[7], argv+7) <= 0)
-	fatal("error initializing SSL handle DANE state\n");
+    /* Create a connection handle, and perhaps one to share its records */
+    ssl = new_ssl(sctx, argv);
+    if (load && (strcmp(load, "policy") == 0 || strcmp(load, "cache") == 0))
+	ssl2 = new_ssl(sctx, argv);
     if (!add_tlsa(ssl, argv))
 	fatal("error adding TLSA RR\n");
+    if (how && strcmp(how, "verdicts") == 0) {
+	if ((verdicts = DANESSL_VERDICTS_new(16, 3600)) == 0)
+	    fatal("error allocating verdict cache\n");
+	ssl2 = new_ssl(sctx, argv);
+	if (DANESSL_set_verdicts(ssl, verdicts) <= 0
+	    || DANESSL_set_verdicts(ssl2, verdicts) <= 0)
+	    fatal("error attaching verdict cache\n");
+	if (!add_tlsa(ssl2, argv))
+	    fatal("error adding TLSA RR\n");
+    }
 
     /* Verify saved server chain */
     chain = load_chain(argv[6]);
-    SSL_set_connect_state(ssl);
-    DANESSL_verify_chain(ssl, chain);
-    print_errors();
-    printf("verify status: %ld\n", ok = SSL_get_verify_result(ssl));
+    ok = verify(ssl, chain, result, sizeof(result));
+    fputs(result, stdout);
+    fresh = new_ssl(sctx, argv);
+    check_fixed(ssl, fresh, argv);
+    DANESSL_cleanup(fresh);
+    SSL_free(fresh);
+    if (how && strcmp(how, "async") == 0)
+	verify_async(sctx, argv, chain, result);
+    if (how && strcmp(how, "batch") == 0)
+	verify_batch(sctx, argv, chain, ssl);
+    if (ssl2) {
+	X509 *match = 0;
+	X509 *match2 = 0;
+
+	/*
+	 * A verdict is reused for a copy of the chain, restoring the match
+	 * from the original.  The compatibility code does not bother to
+	 * cache the cheap DANE-EE(3) matches.
+	 */
+	if (verdicts)
+	    chain2 = load_chain(argv[6]);
+	verify(ssl2, chain2 ? chain2 : chain, result2, sizeof(result2));
+	if (strcmp(result, result2) != 0)
+	    fatal("second connection differs:\n%s", result2);
+	if (verdicts && ok == X509_V_OK
+	    && atoi(argv[1]) != DANESSL_USAGE_DANE_EE
+	    && (DANESSL_get_match_cert(ssl, &match, 0, 0) <= 0
+		|| DANESSL_get_match_cert(ssl2, &match2, 0, 0) <= 0
+		|| match != match2))
+	    fatal("verdict not reused\n");
+    }
+
+    /*
+     * A server verifying the same chain as a client certificate must not
+     * reuse the client's verdict.
+     */
+    if (verdicts) {
+	SSL *server = new_ssl(sctx, argv);
+
+	SSL_set_accept_state(server);
+	if (DANESSL_set_verdicts(server, verdicts) <= 0
+	    || !add_tlsa(server, argv))
+	    fatal("error initializing server connection\n");
+	verify(server, chain, result2, sizeof(result2));
+	printf("server %s", result2);
+	DANESSL_cleanup(server);
+	SSL_free(server);
+    }
 
     /* Cleanup */
     DANESSL_cleanup(ssl);
     SSL_free(ssl);
+    if (ssl2) {
+	DANESSL_cleanup(ssl2);
+	SSL_free(ssl2);
+    }
     SSL_CTX_free(sctx);
+    DANESSL_VERDICTS_free(verdicts);
+    free_rdata();
 
     return ok == X509_V_OK ? 0 : 1;
 }
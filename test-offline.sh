@@ -4,6 +4,8 @@ set -e
 DOMAIN=example.com
 HOST=mail.${DOMAIN}
 TEST=./offline
+# Verification backends to test, each must produce the expected result
+BACKENDS=${BACKENDS:-compat native}
 
 key() {
     local key=$1; shift
@@ -60,10 +62,12 @@ genca() {
     local cert=$1; shift
     local skid=$1; shift
     local akid=$1; shift
+    local extra=$1; shift
     local ca=$1; shift
     local cakey=$1; shift
 
-    exts=$(printf "%s\n%s\n%s\n" "$skid" "$akid" "basicConstraints = CA:true")
+    exts=$(printf "%s\n%s\n%s\n%s\n" "$skid" "$akid" \
+	    "basicConstraints = CA:true" "$extra")
     csr=$(req "$key" "$cn")
     echo "$csr" | cert "$cert" "$exts" -CA "${ca}.pem" -CAkey "${cakey}.pem" \
 	    -set_serial 2 -days 30 "$@"
@@ -113,6 +117,7 @@ gennocn() {
 }
 
 runtest() {
+    local expect=$1; shift
     local desc=$1; shift
     local usage=$1; shift
     local selector=$1; shift
@@ -121,6 +126,7 @@ runtest() {
     local ca=$1; shift
     local chain=$1; shift
     local digest
+    local backend
 
     case $mtype in
     0) digest="";;
@@ -132,12 +138,29 @@ runtest() {
     printf "%d %d %d %-24s %s: " "$usage" "$selector" "$mtype" "$tlsa" "$desc"
 
     if [ -n "$ca" ]; then ca="$ca.pem"; fi
-    "$TEST" "$usage" "$selector" "$digest" "$tlsa.pem" "$ca" "$chain.pem" \
-	"$@" > /dev/null
+    for backend in $BACKENDS; do
+	case $expect in
+	pass|fail) ;;
+	*)  # A specific line of output
+	    DANESSL_BACKEND=$backend "$TEST" "$usage" "$selector" "$digest" \
+		"$tlsa.pem" "$ca" "$chain.pem" "$@" 2>/dev/null |
+		grep -qxF "$expect" || return 1
+	    continue;;
+	esac
+	DANESSL_BACKEND=$backend "$TEST" "$usage" "$selector" "$digest" \
+	    "$tlsa.pem" "$ca" "$chain.pem" "$@" > /dev/null
+	case $? in
+	0) [ "$expect" = pass ] || return 1;;
+	1) [ "$expect" = fail ] || return 1;;
+	*) return 1;;	# Fatal error, not a verification failure
+	esac
+    done
 }
 
-checkpass() { runtest "$@" && { echo pass; } || { echo fail; exit 1; }; }
-checkfail() { runtest "$@" && { echo fail; exit 1; } || { echo pass; }; }
+checkpass() { runtest pass "$@" && { echo pass; } || { echo fail; exit 1; }; }
+checkfail() { runtest fail "$@" && { echo pass; } || { echo fail; exit 1; }; }
+checkline() { runtest "$@" && { echo pass; } || { echo fail; exit 1; }; }
+checkerr() { local err=$1; shift; checkline "verify status: $err" "$@"; }
 
 #---------
 
@@ -162,8 +185,8 @@ for caskid in "" "subjectKeyIdentifier = hash"
 do
 
 genroot "Root CA" rootkey rootcert "$rskid" "$rakid"
-genca "CA 1" cakey1 cacert1 "$caskid" "$cakid" rootcert rootkey
-genca "CA 2" cakey2 cacert2 "$caskid" "$cakid" cacert1 cakey1
+genca "CA 1" cakey1 cacert1 "$caskid" "$cakid" "" rootcert rootkey
+genca "CA 2" cakey2 cacert2 "$caskid" "$cakid" "" cacert1 cakey1
 genee "$HOST" eekey eecert cacert2 cakey2
 
 cat eecert.pem cacert2.pem cacert1.pem rootcert.pem > chain.pem
@@ -193,6 +216,34 @@ done
 done
 done
 
+# A TA key whose issuer keyid has the RFC 5280 length, but is not the SHA-1
+# digest of the key.
+#
+genca "CA 3" cakey3 cacert3 \
+    "subjectKeyIdentifier = $(printf '5a:%.0s' {1..19})5a" "" "" \
+    rootcert rootkey
+genee "$HOST" eekey eecert3 cacert3 cakey3
+checkpass "custom keyid TA" 2 1 0 cacert3 "" eecert3 "$HOST"
+checkpass "custom keyid TA" 2 0 0 cacert3 "" eecert3 "$HOST"
+
+# An intermediate CA whose key usage does not allow certificate signing.
+#
+genca "CA 4" cakey4 cacert4 "" "" "keyUsage = digitalSignature" \
+    rootcert rootkey
+genee "$HOST" eekey eecert4 cacert4 cakey4
+cat eecert4.pem cacert4.pem > chain4.pem
+checkerr 32 "CA without keyCertSign" 0 0 0 rootcert rootcert chain4 "$HOST"
+checkerr 32 "CA without keyCertSign" 2 0 0 rootcert "" chain4 "$HOST"
+
+# The matched certificate depth and name are the same with either backend.
+#
+checkline "match depth: 1 host: $HOST" "match name" 2 0 1 cacert2 "" \
+    chain1 "$HOST"
+checkline "match depth: 1 host: $HOST" "sub-domain match name" 2 0 1 \
+    cacert2 "" chain1 whatever ".$DOMAIN"
+checkline "match depth: 2 host: $HOST" "match name" 0 0 1 cacert1 \
+    rootcert chain1 "$HOST"
+
 # Tests that don't depend on skid/akid chaining
 #
 for s in 0 1; do
@@ -238,4 +289,50 @@ for s in 0 1; do
   done
 done
 
+# Other ways of loading the same TLSA records, see load_tlsa() in offline.c
+#
+for load in rrset rdata rdata-nocopy policy cache; do
+  for s in 0 1; do
+    for m in 0 1 2; do
+      DANESSL_LOAD=$load checkpass "$load valid TA" 2 "$s" "$m" cacert2 "" \
+	  chain1 "$HOST"
+      DANESSL_LOAD=$load checkfail "$load wrong name" 2 "$s" "$m" cacert2 "" \
+	  chain1 whatever
+      DANESSL_LOAD=$load checkpass "$load valid CA" 0 "$s" "$m" rootcert \
+	  rootcert chain1 "$HOST"
+      DANESSL_LOAD=$load checkpass "$load valid EE" 3 "$s" "$m" eecert "" \
+	  chain1 whatever
+      DANESSL_LOAD=$load checkfail "$load wrong EE" 3 "$s" "$m" cacert2 "" \
+	  chain1 whatever
+    done
+  done
+done
+
+# Other ways of verifying the same chains, see main() in offline.c
+#
+for verify in verdicts async batch; do
+  for s in 0 1; do
+    for m in 0 1 2; do
+      DANESSL_VERIFY=$verify checkline "match depth: 1 host: $HOST" \
+	  "$verify valid TA" 2 "$s" "$m" cacert2 "" chain1 "$HOST"
+      DANESSL_VERIFY=$verify checkfail "$verify wrong name" 2 "$s" "$m" \
+	  cacert2 "" chain1 whatever
+      DANESSL_VERIFY=$verify checkpass "$verify valid CA" 0 "$s" "$m" \
+	  rootcert rootcert chain1 "$HOST"
+      DANESSL_VERIFY=$verify checkpass "$verify valid EE" 3 "$s" "$m" \
+	  eecert "" chain1 whatever
+      DANESSL_VERIFY=$verify checkfail "$verify wrong EE" 3 "$s" "$m" \
+	  cacert2 "" chain1 whatever
+    done
+  done
+done
+
+# The leaf certificate is only for servers, a client's verdict must not
+# be reused when verifying it as a client certificate.
+#
+DANESSL_VERIFY=verdicts checkline "server verify status: 26" \
+    "verdicts server" 2 0 1 cacert2 "" chain1 "$HOST"
+DANESSL_VERIFY=verdicts checkline "server verify status: 26" \
+    "verdicts server" 0 0 1 rootcert rootcert chain1 "$HOST"
+
 rm -f *.pem